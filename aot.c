@@ -0,0 +1,709 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#include "aot.h"
+
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "peephole.h"
+
+// Every function of the script, in the order they are emitted, parents before the functions they declare.
+typedef struct {
+    ObjFunction **functions;
+    int count;
+    int capacity;
+} Functions;
+
+static void add_function(Functions *functions, ObjFunction *function) {
+    if (functions->capacity < functions->count + 1) {
+        int old_capacity = functions->capacity;
+        functions->capacity = GROW_CAPACITY(old_capacity);
+        functions->functions = GROW_ARRAY(ObjFunction*, functions->functions, old_capacity, functions->capacity);
+    }
+
+    functions->functions[functions->count++] = function;
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+        if (IS_FUNCTION(constants->values[i])) {
+            add_function(functions, AS_FUNCTION(constants->values[i]));
+        }
+    }
+}
+
+static int function_index(Functions *functions, ObjFunction *function) {
+    for (int i = 0; i < functions->count; ++i) {
+        if (functions->functions[i] == function) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void emit_string(FILE *out, const char *chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; ++i) {
+        unsigned char c = chars[i];
+        if (c == '"' || c == '\\' || c == '?' || c < 0x20 || c >= 0x7f) {
+            // octal escapes take at most 3 digits, so the next character can't extend them.
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void emit_data(FILE *out, Functions *functions, int index) {
+    Chunk *chunk = &functions->functions[index]->chunk;
+
+    fprintf(out, "static const uint8_t code_%d[] = {", index);
+    for (int i = 0; i < chunk->count; ++i) {
+        fprintf(out, "%s%d", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+        fputc(',', out);
+    }
+    fprintf(out, "\n};\n");
+
+    fprintf(out, "static const int lines_%d[] = {", index);
+    for (int i = 0; i < chunk->count; ++i) {
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+    }
+    fprintf(out, "\n};\n");
+
+    if (chunk->constants.count > 0) {
+        fprintf(out, "static const AotConstant constants_%d[] = {\n", index);
+        for (int i = 0; i < chunk->constants.count; ++i) {
+            Value constant = chunk->constants.values[i];
+            if (IS_NUMBER(constant)) {
+                double number = AS_NUMBER(constant);
+                uint64_t bits;
+                memcpy(&bits, &number, sizeof(bits));
+                fprintf(out, "    {AOT_NUMBER, 0x%llxull, NULL, 0},\n", (unsigned long long) bits);
+            } else if (IS_STRING(constant)) {
+                fprintf(out, "    {AOT_STRING, 0, ");
+                emit_string(out, AS_CSTRING(constant), AS_STRING(constant)->length);
+                fprintf(out, ", %d},\n", AS_STRING(constant)->length);
+            } else {
+                fprintf(out, "    {AOT_FUNCTION, %d, NULL, 0},\n", function_index(functions, AS_FUNCTION(constant)));
+            }
+        }
+        fprintf(out, "};\n");
+    }
+
+    if (chunk->far_jump_count > 0) {
+        fprintf(out, "static const FarJump far_jumps_%d[] = {\n", index);
+        for (int i = 0; i < chunk->far_jump_count; ++i) {
+            fprintf(out, "    {%d, %d},\n", chunk->far_jumps[i].offset, chunk->far_jumps[i].instruction);
+        }
+        fprintf(out, "};\n");
+    }
+}
+
+static int read_short(uint8_t *operand) {
+    return (operand[0] << 8) | operand[1];
+}
+
+/**
+ * Returns the C for a register op source operand, a frame slot or a constant, see RK_CONSTANT.
+ */
+static const char *register_operand(char *buffer, size_t size, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        snprintf(buffer, size, "constants[%d]", operand & ~RK_CONSTANT);
+    } else {
+        snprintf(buffer, size, "slots[%d]", operand);
+    }
+    return buffer;
+}
+
+static const char *immediate_operand(char *buffer, size_t size, uint8_t instruction, uint8_t operand) {
+    // the _SMALL and _CONSTANT forms alternate.
+    if ((instruction - OP_ADD_SMALL) % 2 == 0) {
+        snprintf(buffer, size, "%d.0", operand);
+    } else {
+        snprintf(buffer, size, "AS_NUMBER(constants[%d])", operand);
+    }
+    return buffer;
+}
+
+/**
+ * Emits the C of the instruction at offset. Returns false for code it doesn't know, which can't come from compile().
+ */
+static bool emit_instruction(FILE *out, Chunk *chunk, int offset, uint8_t instruction, int length) {
+    uint8_t *code = chunk->code + offset;
+    int next = offset + length;
+    char a[32];
+    char b[32];
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            fprintf(out, "AOT_PUSH(constants[%d]);\n", code[1]);
+            break;
+        case OP_NIL:
+            fprintf(out, "AOT_PUSH(NIL_VAL);\n");
+            break;
+        case OP_TRUE:
+            fprintf(out, "AOT_PUSH(TRUE_VAL);\n");
+            break;
+        case OP_FALSE:
+            fprintf(out, "AOT_PUSH(FALSE_VAL);\n");
+            break;
+        case OP_POP:
+            fprintf(out, "vm.stack_top--;\n");
+            break;
+        case OP_GET_LOCAL:
+            fprintf(out, "AOT_PUSH(slots[%d]);\n", code[1]);
+            break;
+        case OP_SET_LOCAL:
+            fprintf(out, "slots[%d] = AOT_PEEK(0);\n", code[1]);
+            break;
+        case OP_GET_GLOBAL:
+            fprintf(out, "AOT_CHECK(%d, jit_get_global(%d));\n", next, code[1]);
+            break;
+        case OP_DEFINE_GLOBAL:
+            fprintf(out, "jit_define_global(%d);\n", code[1]);
+            break;
+        case OP_SET_GLOBAL:
+            fprintf(out, "AOT_CHECK(%d, jit_set_global(%d));\n", next, code[1]);
+            break;
+        case OP_GET_UPVALUE:
+            fprintf(out, "AOT_PUSH(*frame->closure->upvalues[%d]->location);\n", code[1]);
+            break;
+        case OP_SET_UPVALUE:
+            fprintf(out, "*frame->closure->upvalues[%d]->location = AOT_PEEK(0);\n", code[1]);
+            break;
+        case OP_GET_ENCLOSING:
+            fprintf(out, "AOT_PUSH(vm.stack[frame->closure->frame_base + %d]);\n", code[1]);
+            break;
+        case OP_SET_ENCLOSING:
+            fprintf(out, "vm.stack[frame->closure->frame_base + %d] = AOT_PEEK(0);\n", code[1]);
+            break;
+        case OP_GET_PROPERTY:
+            fprintf(out, "AOT_CHECK(%d, jit_get_property(AS_STRING(constants[%d]), &chunk->property_caches[%d]));\n",
+                    next, code[1], read_short(code + 2));
+            break;
+        case OP_SET_PROPERTY:
+            fprintf(out, "AOT_CHECK(%d, jit_set_property(AS_STRING(constants[%d])));\n", next, code[1]);
+            break;
+        case OP_GET_SUPER:
+            fprintf(out, "AOT_CHECK(%d, jit_get_super(AS_STRING(constants[%d]), &chunk->inline_caches[%d]));\n",
+                    next, code[1], read_short(code + 2));
+            break;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            fprintf(out, "AOT_CHECK(%d, %s(AS_STRING(constants[%d]), %d, &chunk->inline_caches[%d]));\n", next,
+                    instruction == OP_INVOKE ? "aot_invoke" : "aot_super_invoke", code[1], code[2],
+                    read_short(code + 3));
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            fprintf(out, "vm.stack_top[-2] = BOOL_VAL(%svalues_equal(vm.stack_top[-2], vm.stack_top[-1])); "
+                         "vm.stack_top--;\n", instruction == OP_NOT_EQUAL ? "!" : "");
+            break;
+        case OP_GREATER:
+            fprintf(out, "AOT_BINARY(%d, BOOL_VAL, a > b);\n", next);
+            break;
+        case OP_LESS:
+            fprintf(out, "AOT_BINARY(%d, BOOL_VAL, a < b);\n", next);
+            break;
+        case OP_GREATER_EQUAL:
+            fprintf(out, "AOT_BINARY(%d, BOOL_VAL, !(a < b));\n", next);
+            break;
+        case OP_LESS_EQUAL:
+            fprintf(out, "AOT_BINARY(%d, BOOL_VAL, !(a > b));\n", next);
+            break;
+        case OP_ADD:
+            fprintf(out, "AOT_ADD(%d);\n", next);
+            break;
+        case OP_SUBTRACT:
+            fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, a - b);\n", next);
+            break;
+        case OP_MULTIPLY:
+            fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, a * b);\n", next);
+            break;
+        case OP_DIVIDE:
+            fprintf(out, "AOT_BINARY(%d, NUMBER_VAL, a / b);\n", next);
+            break;
+        case OP_NOT:
+            fprintf(out, "vm.stack_top[-1] = BOOL_VAL(AOT_FALSEY(vm.stack_top[-1]));\n");
+            break;
+        case OP_NEGATE:
+            fprintf(out, "if (!IS_NUMBER(AOT_PEEK(0))) AOT_ERROR(%d, \"Operand must be a number\");\n"
+                         "    vm.stack_top[-1] = NUMBER_VAL(-AS_NUMBER(vm.stack_top[-1]));\n", next);
+            break;
+        case OP_PRINT:
+            fprintf(out, "jit_print();\n");
+            break;
+        case OP_JUMP:
+        case OP_JUMP_FAR:
+        case OP_LOOP:
+        case OP_LOOP_FAR:
+            fprintf(out, "goto L%d;\n", jump_target(chunk, offset));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_FAR:
+            fprintf(out, "if (AOT_FALSEY(AOT_PEEK(0))) goto L%d;\n", jump_target(chunk, offset));
+            break;
+        case OP_CALL:
+            fprintf(out, "AOT_CHECK(%d, aot_call(%d));\n", next, code[1]);
+            break;
+        case OP_TAIL_CALL:
+            fprintf(out, "AOT_AT(%d); return aot_tail_call(%d);\n", next, code[1]);
+            break;
+        case OP_TAIL_INVOKE:
+            fprintf(out, "AOT_AT(%d); return aot_tail_invoke(AS_STRING(constants[%d]), %d, &chunk->inline_caches[%d]);\n",
+                    next, code[1], code[2], read_short(code + 3));
+            break;
+        case OP_CLOSURE:
+            // the captures follow the constant, where the helper reads them from.
+            fprintf(out, "AOT_AT(%d); jit_closure(AS_FUNCTION(constants[%d]), false); AOT_RELOAD();\n", offset + 2,
+                    code[1]);
+            break;
+        case OP_CLOSE_UPVALUE:
+            fprintf(out, "jit_close_upvalue();\n");
+            break;
+        case OP_CLASS:
+            fprintf(out, "jit_class(AS_STRING(constants[%d])); AOT_RELOAD();\n", code[1]);
+            break;
+        case OP_METHOD:
+            fprintf(out, "jit_method(AS_STRING(constants[%d]));\n", code[1]);
+            break;
+        case OP_INHERIT:
+            fprintf(out, "AOT_CHECK(%d, jit_inherit());\n", next);
+            break;
+        case OP_SEAL:
+            fprintf(out, "jit_seal();\n");
+            break;
+        case OP_RETURN:
+            fprintf(out, "jit_return(); return true;\n");
+            break;
+        case OP_WIDE: {
+            int operand = read_wide_operand(code + 2);
+            switch (code[1]) {
+                case OP_CONSTANT:
+                    fprintf(out, "AOT_PUSH(constants[%d]);\n", operand);
+                    break;
+                case OP_GET_LOCAL:
+                    fprintf(out, "AOT_PUSH(slots[%d]);\n", operand);
+                    break;
+                case OP_SET_LOCAL:
+                    fprintf(out, "slots[%d] = AOT_PEEK(0);\n", operand);
+                    break;
+                case OP_GET_UPVALUE:
+                    fprintf(out, "AOT_PUSH(*frame->closure->upvalues[%d]->location);\n", operand);
+                    break;
+                case OP_SET_UPVALUE:
+                    fprintf(out, "*frame->closure->upvalues[%d]->location = AOT_PEEK(0);\n", operand);
+                    break;
+                case OP_GET_ENCLOSING:
+                    fprintf(out, "AOT_PUSH(vm.stack[frame->closure->frame_base + %d]);\n", operand);
+                    break;
+                case OP_SET_ENCLOSING:
+                    fprintf(out, "vm.stack[frame->closure->frame_base + %d] = AOT_PEEK(0);\n", operand);
+                    break;
+                case OP_GET_GLOBAL:
+                    fprintf(out, "AOT_CHECK(%d, jit_get_global(%d));\n", next, operand);
+                    break;
+                case OP_DEFINE_GLOBAL:
+                    fprintf(out, "jit_define_global(%d);\n", operand);
+                    break;
+                case OP_SET_GLOBAL:
+                    fprintf(out, "AOT_CHECK(%d, jit_set_global(%d));\n", next, operand);
+                    break;
+                case OP_GET_PROPERTY:
+                    // only the narrow form uses its property cache.
+                    fprintf(out, "AOT_CHECK(%d, jit_get_property(AS_STRING(constants[%d]), NULL));\n", next, operand);
+                    break;
+                case OP_SET_PROPERTY:
+                    fprintf(out, "AOT_CHECK(%d, jit_set_property(AS_STRING(constants[%d])));\n", next, operand);
+                    break;
+                case OP_GET_SUPER:
+                    fprintf(out, "AOT_CHECK(%d, jit_get_super(AS_STRING(constants[%d]), &chunk->inline_caches[%d]));\n",
+                            next, operand, read_short(code + 5));
+                    break;
+                case OP_INVOKE:
+                case OP_SUPER_INVOKE:
+                    fprintf(out, "AOT_CHECK(%d, %s(AS_STRING(constants[%d]), %d, &chunk->inline_caches[%d]));\n", next,
+                            code[1] == OP_INVOKE ? "aot_invoke" : "aot_super_invoke", operand, code[5],
+                            read_short(code + 6));
+                    break;
+                case OP_TAIL_INVOKE:
+                    fprintf(out, "AOT_AT(%d); return aot_tail_invoke(AS_STRING(constants[%d]), %d, "
+                                 "&chunk->inline_caches[%d]);\n", next, operand, code[5], read_short(code + 6));
+                    break;
+                case OP_CLOSURE:
+                    fprintf(out, "AOT_AT(%d); jit_closure(AS_FUNCTION(constants[%d]), true); AOT_RELOAD();\n",
+                            offset + 5, operand);
+                    break;
+                case OP_CLASS:
+                    fprintf(out, "jit_class(AS_STRING(constants[%d])); AOT_RELOAD();\n", operand);
+                    break;
+                case OP_METHOD:
+                    fprintf(out, "jit_method(AS_STRING(constants[%d]));\n", operand);
+                    break;
+                default:
+                    return false;
+            }
+            break;
+        }
+        case OP_ADD_SMALL:
+        case OP_ADD_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, NUMBER_VAL, a + b, %s, \"Operands must be two numbers or two strings.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_SUBTRACT_SMALL:
+        case OP_SUBTRACT_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, NUMBER_VAL, a - b, %s, \"Operands must be numbers.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_LESS_SMALL:
+        case OP_LESS_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, BOOL_VAL, a < b, %s, \"Operands must be numbers.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_LESS_EQUAL_SMALL:
+        case OP_LESS_EQUAL_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, BOOL_VAL, !(a > b), %s, \"Operands must be numbers.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_GREATER_SMALL:
+        case OP_GREATER_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, BOOL_VAL, a > b, %s, \"Operands must be numbers.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_GREATER_EQUAL_SMALL:
+        case OP_GREATER_EQUAL_CONSTANT:
+            fprintf(out, "AOT_IMMEDIATE(%d, BOOL_VAL, !(a < b), %s, \"Operands must be numbers.\");\n",
+                    next, immediate_operand(b, sizeof(b), instruction, code[1]));
+            break;
+        case OP_REG_MOVE:
+            fprintf(out, "slots[%d] = %s;\n", code[1], register_operand(a, sizeof(a), code[2]));
+            break;
+        case OP_REG_ADD:
+            fprintf(out, "AOT_REGISTER_ADD(%d, %d, %s, %s);\n", next, code[1],
+                    register_operand(a, sizeof(a), code[2]), register_operand(b, sizeof(b), code[3]));
+            break;
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+            fprintf(out, "AOT_REGISTER_BINARY(%d, %d, %s, %s, a %c b);\n", next, code[1],
+                    register_operand(a, sizeof(a), code[2]), register_operand(b, sizeof(b), code[3]),
+                    instruction == OP_REG_SUBTRACT ? '-' : instruction == OP_REG_MULTIPLY ? '*' : '/');
+            break;
+        case OP_REG_JUMP_UNLESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+        case OP_REG_JUMP_UNLESS_GREATER:
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_REG_JUMP_UNLESS_LESS:
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_FAR: {
+            int target = jump_target(chunk, offset);
+            if (instruction == OP_REG_JUMP_UNLESS_FAR) {
+                instruction = chunk->far_jumps[read_short(code + 3)].instruction;
+            }
+            register_operand(a, sizeof(a), code[1]);
+            register_operand(b, sizeof(b), code[2]);
+            switch (instruction) {
+                case OP_REG_JUMP_UNLESS_EQUAL:
+                case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+                    fprintf(out, "if (%svalues_equal(%s, %s)) goto L%d;\n",
+                            instruction == OP_REG_JUMP_UNLESS_EQUAL ? "!" : "", a, b, target);
+                    break;
+                case OP_REG_JUMP_UNLESS_GREATER:
+                    fprintf(out, "AOT_REGISTER_JUMP_UNLESS(%d, %s, %s, a > b, L%d);\n", next, a, b, target);
+                    break;
+                case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+                    fprintf(out, "AOT_REGISTER_JUMP_UNLESS(%d, %s, %s, !(a < b), L%d);\n", next, a, b, target);
+                    break;
+                case OP_REG_JUMP_UNLESS_LESS:
+                    fprintf(out, "AOT_REGISTER_JUMP_UNLESS(%d, %s, %s, a < b, L%d);\n", next, a, b, target);
+                    break;
+                default:
+                    fprintf(out, "AOT_REGISTER_JUMP_UNLESS(%d, %s, %s, !(a > b), L%d);\n", next, a, b, target);
+                    break;
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+static bool emit_code(FILE *out, Functions *functions, int index) {
+    Chunk *chunk = &functions->functions[index]->chunk;
+
+    // only jump targets get a label, unused ones would be warned about.
+    bool *is_target = ALLOCATE(bool, chunk->count);
+    memset(is_target, 0, sizeof(bool) * chunk->count);
+    for (int offset = 0; offset < chunk->count;) {
+        int length;
+        decode_instruction(chunk, offset, &length);
+        int target = jump_target(chunk, offset);
+        if (target >= 0 && target < chunk->count) {
+            is_target[target] = true;
+        }
+        offset += length;
+    }
+
+    fprintf(out, "static bool function_%d(CallFrame *frame) {\n", index);
+    fprintf(out, "    Value *slots = frame->slots;\n");
+    fprintf(out, "    Chunk *chunk = &frame->closure->function->chunk;\n");
+    fprintf(out, "    uint8_t *code = chunk->code;\n");
+    fprintf(out, "    Value *constants = chunk->constants.values;\n");
+    fprintf(out, "    (void) slots, (void) chunk, (void) code, (void) constants;\n");
+
+    bool emitted = true;
+    for (int offset = 0; offset < chunk->count && emitted;) {
+        int length;
+        uint8_t instruction = decode_instruction(chunk, offset, &length);
+        if (is_target[offset]) {
+            fprintf(out, "L%d:\n", offset);
+        }
+        fprintf(out, "    ");
+        emitted = emit_instruction(out, chunk, offset, instruction, length);
+        offset += length;
+    }
+    fprintf(out, "}\n\n");
+
+    FREE_ARRAY(bool, is_target, chunk->count);
+    return emitted;
+}
+
+static void emit_descriptor(FILE *out, Functions *functions, int index) {
+    ObjFunction *function = functions->functions[index];
+    Chunk *chunk = &function->chunk;
+
+    fprintf(out, "    {");
+    if (function->name == NULL) {
+        fprintf(out, "NULL, 0");
+    } else {
+        emit_string(out, function->name->chars, function->name->length);
+        fprintf(out, ", %d", function->name->length);
+    }
+    fprintf(out, ", %d, %d, %d, %d, code_%d, lines_%d, %d, ", function->arity, function->upvalue_count,
+            function->slot_count, function->stack_size, index, index, chunk->count);
+    if (chunk->constants.count > 0) {
+        fprintf(out, "constants_%d, %d, ", index, chunk->constants.count);
+    } else {
+        fprintf(out, "NULL, 0, ");
+    }
+    if (chunk->far_jump_count > 0) {
+        fprintf(out, "far_jumps_%d, %d, ", index, chunk->far_jump_count);
+    } else {
+        fprintf(out, "NULL, 0, ");
+    }
+    fprintf(out, "%d, %d, function_%d},\n", chunk->inline_cache_count, chunk->property_cache_count, index);
+}
+
+/**
+ * Compiles source and writes it out as a C program. Returns false on a compile error.
+ */
+bool aot_compile(const char *source, FILE *out) {
+    ObjFunction *script = compile(source);
+    if (script == NULL) {
+        return false;
+    }
+
+    Functions functions = {NULL, 0, 0};
+    add_function(&functions, script);
+
+    fprintf(out, "// Compiled by clox --emit-c, link with the clox runtime.\n\n");
+    fprintf(out, "#include \"aot.h\"\n\n");
+    for (int i = 0; i < functions.count; ++i) {
+        fprintf(out, "static bool function_%d(CallFrame *frame);\n", i);
+    }
+    fprintf(out, "\n");
+
+    bool compiled = true;
+    for (int i = 0; i < functions.count && compiled; ++i) {
+        emit_data(out, &functions, i);
+        fprintf(out, "\n");
+        compiled = emit_code(out, &functions, i);
+    }
+
+    fprintf(out, "static const AotFunction functions[] = {\n");
+    for (int i = 0; i < functions.count; ++i) {
+        emit_descriptor(out, &functions, i);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static const AotString globals[] = {\n");
+    for (int i = 0; i < vm.global_names.count; ++i) {
+        ObjString *name = AS_STRING(vm.global_names.values[i]);
+        fprintf(out, "    {");
+        emit_string(out, name->chars, name->length);
+        fprintf(out, ", %d},\n", name->length);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    return aot_main(functions, %d, globals, %d);\n", functions.count, vm.global_names.count);
+    fprintf(out, "}\n");
+
+    FREE_ARRAY(ObjFunction*, functions.functions, functions.capacity);
+    if (!compiled) {
+        fprintf(stderr, "Can't compile the script to C.\n");
+    }
+    return compiled;
+}
+
+static Value load_constant(const AotConstant *constant, int function_count) {
+    switch (constant->type) {
+        case AOT_NUMBER: {
+            double number;
+            memcpy(&number, &constant->value, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case AOT_STRING:
+            return OBJ_VAL(copy_string(constant->chars, constant->length));
+        default:
+            // loaded before the functions declaring it, and still on the stack.
+            return vm.stack[function_count - 1 - constant->value];
+    }
+}
+
+/**
+ * Rebuilds the function of descriptor, leaving it on the stack.
+ */
+static void load_function(const AotFunction *descriptor, int function_count) {
+    ObjFunction *function = new_function();
+    push(OBJ_VAL(function));
+    function->arity = descriptor->arity;
+    function->upvalue_count = descriptor->upvalue_count;
+    function->slot_count = descriptor->slot_count;
+    function->stack_size = descriptor->stack_size;
+    function->compiled = descriptor->compiled;
+    if (descriptor->name != NULL) {
+        function->name = copy_string(descriptor->name, descriptor->name_length);
+    }
+
+    Chunk *chunk = &function->chunk;
+    for (int i = 0; i < descriptor->count; ++i) {
+        write_chunk(chunk, descriptor->code[i], descriptor->lines[i]);
+    }
+    for (int i = 0; i < descriptor->constant_count; ++i) {
+        push(load_constant(&descriptor->constants[i], function_count));
+        add_constant(chunk, vm.stack_top[-1]);
+        pop();
+    }
+    for (int i = 0; i < descriptor->far_jump_count; ++i) {
+        add_far_jump(chunk, descriptor->far_jumps[i].offset, descriptor->far_jumps[i].instruction);
+    }
+    for (int i = 0; i < descriptor->inline_cache_count; ++i) {
+        add_inline_cache(chunk);
+    }
+    for (int i = 0; i < descriptor->property_cache_count; ++i) {
+        add_property_cache(chunk);
+    }
+}
+
+// set by a tail call whose callee took over the frame, for run_frame() to run the callee in it next.
+static bool tail_call_pending = false;
+
+/**
+ * Runs the frame a call pushed, if any, to its return. The function of a frame hands it over to the callee of a tail
+ * call by returning, so that a chain of tail calls takes no C stack either.
+ */
+static bool run_frame(JitStatus status) {
+    if (status == JIT_ERROR) {
+        return false;
+    }
+
+    if (status == JIT_FRAME) {
+        int frame_count = vm.frame_count;
+        do {
+            // the frames may have moved while the last callee ran.
+            CallFrame *frame = &vm.frames[frame_count - 1];
+            tail_call_pending = false;
+            if (!frame->closure->function->compiled(frame)) {
+                return false;
+            }
+        } while (tail_call_pending);
+    }
+
+    return true;
+}
+
+bool aot_call(int arg_count) {
+    return run_frame(jit_call(arg_count));
+}
+
+bool aot_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    return run_frame(jit_invoke(name, arg_count, cache));
+}
+
+bool aot_super_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    return run_frame(jit_super_invoke(name, arg_count, cache));
+}
+
+/**
+ * Returns for the function that made a tail call, unless the callee took over its frame, which run_frame() then runs.
+ * Otherwise the callee got a frame of its own or none, and the OP_RETURN after the call is still to come.
+ */
+static bool finish_tail_call(JitStatus status, int frame_count) {
+    if (status == JIT_FRAME && vm.frame_count == frame_count) {
+        tail_call_pending = true;
+        return true;
+    }
+
+    if (!run_frame(status)) {
+        return false;
+    }
+
+    jit_return();
+    return true;
+}
+
+bool aot_tail_call(int arg_count) {
+    int frame_count = vm.frame_count;
+    return finish_tail_call(jit_tail_call(arg_count), frame_count);
+}
+
+bool aot_tail_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    int frame_count = vm.frame_count;
+    return finish_tail_call(jit_tail_invoke(name, arg_count, cache), frame_count);
+}
+
+int aot_main(const AotFunction *functions, int function_count, const AotString *globals, int global_count) {
+    init_virtual_machine();
+
+    for (int i = 0; i < global_count; ++i) {
+        if (global_slot(copy_string(globals[i].chars, globals[i].length)) != i) {
+            fprintf(stderr, "The script was compiled for another runtime.\n");
+            free_virtual_machine();
+            return 70;
+        }
+    }
+
+    // the functions a function declares come after it, so loading them last to first makes them there for it.
+    // Function i stays on the stack, in slot function_count - 1 - i, until the script is loaded.
+    reserve_stack(function_count + FRAME_HEADROOM);
+    for (int i = function_count - 1; i >= 0; --i) {
+        load_function(&functions[i], function_count);
+    }
+
+    // the script is the last one loaded, and the closure keeps all of them alive from here on.
+    ObjClosure *closure = new_closure(AS_FUNCTION(vm.stack_top[-1]));
+    vm.stack_top = vm.stack;
+    push(OBJ_VAL(closure));
+
+    // like interpret(), but the frame ip is only as recent as the last call into the runtime.
+    sigjmp_buf stack_overflow;
+    bool ok;
+    if (sigsetjmp(stack_overflow, 1) != 0) {
+        runtime_error("Stack overflow.");
+        ok = false;
+    } else {
+        vm.stack_overflow = &stack_overflow;
+        ok = aot_call(0);
+    }
+    vm.stack_overflow = NULL;
+
+    free_virtual_machine();
+    return ok ? 0 : 70;
+}
@@ -0,0 +1,186 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+#include "jit.h"
+
+// Ahead-of-time compilation of a script to C, one C function per Lox function. The C runs on the same runtime as
+// run() does, with the value stack, call frames and the GC, and only leaves out the dispatch:
+//
+//     clox --emit-c script.lox > script.c
+//     cc -I<clox sources> script.c libclox_runtime.a -o script
+//
+// Besides its code, the C carries the chunk of each function, which aot_main() rebuilds before running the script:
+// the constants and caches the code refers to, and the lines and operands runtime errors and closures read.
+
+typedef enum {
+    AOT_NUMBER,
+    AOT_STRING,
+    AOT_FUNCTION,
+} AotConstantType;
+
+typedef struct {
+    AotConstantType type;
+    // the bits of a number, or the index of a function in the program's functions.
+    uint64_t value;
+    const char *chars;
+    int length;
+} AotConstant;
+
+typedef struct {
+    const char *chars;
+    int length;
+} AotString;
+
+typedef struct {
+    // NULL for the script.
+    const char *name;
+    int name_length;
+    int arity;
+    int upvalue_count;
+    int slot_count;
+    int stack_size;
+    const uint8_t *code;
+    const int *lines;
+    int count;
+    const AotConstant *constants;
+    int constant_count;
+    const FarJump *far_jumps;
+    int far_jump_count;
+    int inline_cache_count;
+    int property_cache_count;
+    bool (*compiled)(CallFrame *frame);
+} AotFunction;
+
+bool aot_compile(const char *source, FILE *out);
+
+// Runs the script, the first of functions, whose globals take the slots of globals in order. Returns an exit code.
+int aot_main(const AotFunction *functions, int function_count, const AotString *globals, int global_count);
+
+// Call the helper of the same name in jit.h and run the frame it pushed, if any, to its return.
+bool aot_call(int arg_count);
+
+bool aot_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+bool aot_super_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+// Make a tail call and the return after it, for the emitted C to return what they do.
+bool aot_tail_call(int arg_count);
+
+bool aot_tail_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+// What the emitted C spells its instructions with, where frame, slots, code and constants are those of the function
+// running. Each takes the offset of the next instruction, to leave frame->ip at when it calls into the runtime.
+
+#define AOT_PUSH(value) (*vm.stack_top++ = (value))
+
+#define AOT_POP() (*--vm.stack_top)
+
+#define AOT_PEEK(distance) (vm.stack_top[-1 - (distance)])
+
+#define AOT_AT(next) (frame->ip = code + (next))
+
+#define AOT_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+#define AOT_ERROR(next, message) \
+    do { \
+        AOT_AT(next); \
+        runtime_error(message); \
+        return false; \
+    } while (false)
+
+// The frames and the stack move when they grow, see grow_stack() in vm.c, so the runtime may leave frame and slots
+// pointing at where they were.
+#define AOT_RELOAD() (frame = &vm.frames[vm.frame_count - 1], slots = frame->slots)
+
+#define AOT_CHECK(next, call) \
+    do { \
+        AOT_AT(next); \
+        if (!(call)) { \
+            return false; \
+        } \
+        AOT_RELOAD(); \
+    } while (false)
+
+// applies expression over the two numbers a and b on top of the stack.
+#define AOT_BINARY(next, value_type, expression) \
+    do { \
+        if (!IS_NUMBER(AOT_PEEK(0)) || !IS_NUMBER(AOT_PEEK(1))) { \
+            AOT_ERROR(next, "Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(AOT_POP()); \
+        double a = AS_NUMBER(AOT_POP()); \
+        AOT_PUSH(value_type(expression)); \
+    } while (false)
+
+#define AOT_ADD(next) \
+    do { \
+        if (IS_NUMBER(AOT_PEEK(0)) && IS_NUMBER(AOT_PEEK(1))) { \
+            double b = AS_NUMBER(AOT_POP()); \
+            double a = AS_NUMBER(AOT_POP()); \
+            AOT_PUSH(NUMBER_VAL(a + b)); \
+        } else { \
+            AOT_CHECK(next, jit_add()); \
+        } \
+    } while (false)
+
+// applies expression over the number a on top of the stack and the immediate b, in place.
+#define AOT_IMMEDIATE(next, value_type, expression, b_value, message) \
+    do { \
+        if (!IS_NUMBER(AOT_PEEK(0))) { \
+            AOT_ERROR(next, message); \
+        } \
+        double a = AS_NUMBER(AOT_PEEK(0)); \
+        double b = (b_value); \
+        vm.stack_top[-1] = value_type(expression); \
+    } while (false)
+
+#define AOT_REGISTER_BINARY(next, dst, lhs, rhs, expression) \
+    do { \
+        Value a_value = (lhs); \
+        Value b_value = (rhs); \
+        if (!IS_NUMBER(a_value) || !IS_NUMBER(b_value)) { \
+            AOT_ERROR(next, "Operands must be numbers."); \
+        } \
+        double a = AS_NUMBER(a_value); \
+        double b = AS_NUMBER(b_value); \
+        slots[dst] = NUMBER_VAL(expression); \
+    } while (false)
+
+#define AOT_REGISTER_ADD(next, dst, lhs, rhs) \
+    do { \
+        Value a_value = (lhs); \
+        Value b_value = (rhs); \
+        if (IS_NUMBER(a_value) && IS_NUMBER(b_value)) { \
+            slots[dst] = NUMBER_VAL(AS_NUMBER(a_value) + AS_NUMBER(b_value)); \
+        } else { \
+            AOT_PUSH(a_value); \
+            AOT_PUSH(b_value); \
+            AOT_CHECK(next, jit_add()); \
+            slots[dst] = AOT_POP(); \
+        } \
+    } while (false)
+
+// jumps to label unless test holds for the two register operands, as numbers a and b.
+#define AOT_REGISTER_JUMP_UNLESS(next, lhs, rhs, test, label) \
+    do { \
+        Value a_value = (lhs); \
+        Value b_value = (rhs); \
+        if (!IS_NUMBER(a_value) || !IS_NUMBER(b_value)) { \
+            AOT_ERROR(next, "Operands must be numbers."); \
+        } \
+        double a = AS_NUMBER(a_value); \
+        double b = AS_NUMBER(b_value); \
+        if (!(test)) { \
+            goto label; \
+        } \
+    } while (false)
+
+#endif //CLOX_AOT_H
@@ -3,9 +3,11 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
+#include "object.h"
 
 
 void init_chunk(Chunk *chunk) {
@@ -14,6 +16,15 @@ void init_chunk(Chunk *chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     init_value_array(&chunk->constants);
+    chunk->far_jump_count = 0;
+    chunk->far_jump_capacity = 0;
+    chunk->far_jumps = NULL;
+    chunk->inline_cache_count = 0;
+    chunk->inline_cache_capacity = 0;
+    chunk->inline_caches = NULL;
+    chunk->property_cache_count = 0;
+    chunk->property_cache_capacity = 0;
+    chunk->property_caches = NULL;
 }
 
 void write_chunk(Chunk *chunk, uint8_t byte, int line) {
@@ -33,6 +44,9 @@ void free_chunk(Chunk *chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(FarJump, chunk->far_jumps, chunk->far_jump_capacity);
+    FREE_ARRAY(InlineCache, chunk->inline_caches, chunk->inline_cache_capacity);
+    FREE_ARRAY(PropertyCache, chunk->property_caches, chunk->property_cache_capacity);
     init_chunk(chunk);
 }
 
@@ -43,3 +57,222 @@ int add_constant(Chunk *chunk, Value val) {
     pop();
     return chunk->constants.count - 1;
 }
+
+/**
+ * Records a jump too far for a 16-bit operand and returns its index in the far-jump table.
+ */
+int add_far_jump(Chunk *chunk, int offset, uint8_t instruction) {
+    if (chunk->far_jump_capacity < chunk->far_jump_count + 1) {
+        int old_capacity = chunk->far_jump_capacity;
+        chunk->far_jump_capacity = GROW_CAPACITY(old_capacity);
+        chunk->far_jumps = GROW_ARRAY(FarJump, chunk->far_jumps, old_capacity, chunk->far_jump_capacity);
+    }
+
+    chunk->far_jumps[chunk->far_jump_count].offset = offset;
+    chunk->far_jumps[chunk->far_jump_count].instruction = instruction;
+    return chunk->far_jump_count++;
+}
+
+/**
+ * Adds an empty inline cache for a call site and returns its index.
+ */
+int add_inline_cache(Chunk *chunk) {
+    if (chunk->inline_cache_capacity < chunk->inline_cache_count + 1) {
+        int old_capacity = chunk->inline_cache_capacity;
+        chunk->inline_cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->inline_caches = GROW_ARRAY(InlineCache, chunk->inline_caches, old_capacity,
+                                          chunk->inline_cache_capacity);
+    }
+
+    memset(&chunk->inline_caches[chunk->inline_cache_count], 0, sizeof(InlineCache));
+    return chunk->inline_cache_count++;
+}
+
+int add_property_cache(Chunk *chunk) {
+    if (chunk->property_cache_capacity < chunk->property_cache_count + 1) {
+        int old_capacity = chunk->property_cache_capacity;
+        chunk->property_cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->property_caches = GROW_ARRAY(PropertyCache, chunk->property_caches, old_capacity,
+                                            chunk->property_cache_capacity);
+    }
+
+    PropertyCache *cache = &chunk->property_caches[chunk->property_cache_count];
+    cache->shape = NULL;
+    cache->slot = 0;
+    return chunk->property_cache_count++;
+}
+
+/**
+ * Returns the number of bytes taken by the instruction at offset, operands included.
+ */
+int instruction_length(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_SET_ENCLOSING:
+        case OP_SET_PROPERTY:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_ADD_SMALL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_SMALL:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_SMALL:
+        case OP_LESS_CONSTANT:
+        case OP_LESS_EQUAL_SMALL:
+        case OP_LESS_EQUAL_CONSTANT:
+        case OP_GREATER_SMALL:
+        case OP_GREATER_CONSTANT:
+        case OP_GREATER_EQUAL_SMALL:
+        case OP_GREATER_EQUAL_CONSTANT:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_FAR:
+        case OP_JUMP_IF_FALSE_FAR:
+        case OP_LOOP_FAR:
+        case OP_REG_MOVE:
+            return 3;
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_CACHED:
+        case OP_GET_SUPER:
+            return 4;
+        case OP_REG_JUMP_UNLESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+        case OP_REG_JUMP_UNLESS_GREATER:
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_REG_JUMP_UNLESS_LESS:
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_FAR:
+        case OP_SUPER_INVOKE:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_ADD_LOCAL_LOCAL:
+            return 5;
+        case OP_GET_LOCAL_PROPERTY:
+            return 6;
+        case OP_LESS_LOCAL_SMALL_JUMP:
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return 7;
+        case OP_LESS_LOCAL_LOCAL_JUMP:
+            return 8;
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalue_count * 2;
+        }
+        case OP_WIDE: {
+            if (chunk->code[offset + 1] == OP_CLOSURE) {
+                Value function = chunk->constants.values[read_wide_operand(chunk->code + offset + 2)];
+                return 5 + AS_FUNCTION(function)->upvalue_count * 4;
+            }
+            // the prefix, and two more bytes for the widened operand.
+            return 3 + instruction_length(chunk, offset + 1);
+        }
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Returns the offset the jump at offset goes to, or -1 if the instruction there is no jump.
+ */
+int jump_target(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return offset + 3 + ((code[1] << 8) | code[2]);
+        case OP_LOOP:
+            return offset + 3 - ((code[1] << 8) | code[2]);
+        case OP_REG_JUMP_UNLESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+        case OP_REG_JUMP_UNLESS_GREATER:
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_REG_JUMP_UNLESS_LESS:
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+            return offset + 5 + ((code[3] << 8) | code[4]);
+        case OP_JUMP_FAR:
+        case OP_JUMP_IF_FALSE_FAR:
+            return offset + 3 + chunk->far_jumps[(code[1] << 8) | code[2]].offset;
+        case OP_LOOP_FAR:
+            return offset + 3 - chunk->far_jumps[(code[1] << 8) | code[2]].offset;
+        case OP_REG_JUMP_UNLESS_FAR:
+            return offset + 5 + chunk->far_jumps[(code[3] << 8) | code[4]].offset;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Returns how many values the instruction at offset leaves on the stack, less how many it takes off. Calls count their
+ * result in place of the callee. Takes the instructions the compiler emits, before fuse_superinstructions().
+ */
+int stack_effect(Chunk *chunk, int offset) {
+    uint8_t *code = chunk->code + offset;
+    // the argument count of an invoke follows its name, which takes 3 bytes after OP_WIDE.
+    int arg_count = 2;
+    if (code[0] == OP_WIDE) {
+        code++;
+        arg_count = 4;
+    }
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            return 1;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_RETURN:
+        case OP_PRINT:
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CLOSE_UPVALUE:
+        case OP_METHOD:
+        case OP_INHERIT:
+            return -1;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -code[arg_count];
+        case OP_SUPER_INVOKE:
+            // the superclass goes too.
+            return -code[arg_count] - 1;
+        default:
+            return 0;
+    }
+}
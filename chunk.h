@@ -17,7 +17,9 @@ typedef enum {
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
-    // TODO: add !=, <=, and >= to have better performance
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
     OP_NEGATE,
     OP_ADD,
     OP_SUBTRACT,
@@ -48,8 +50,107 @@ typedef enum {
     OP_METHOD,
     OP_INVOKE,
     OP_INHERIT,
+    // Ends a class declaration, see seal_class().
+    OP_SEAL,
+    // A call whose result the function returns. It reuses the frame of the function, see tail_call() in compiler.c,
+    // and has the operands of OP_CALL or OP_INVOKE.
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+    // Read and write a slot of the frame the running closure was created in, for a closure that never outlives it,
+    // see bind_to_frame() in compiler.c. The operand is that frame slot, where OP_GET_UPVALUE names an upvalue.
+    OP_GET_ENCLOSING,
+    OP_SET_ENCLOSING,
+    // Prefix for an instruction whose first operand doesn't fit in a byte, see WIDE_OPERAND_MAX.
+    OP_WIDE,
+    // Jumps patched to reach further than their 16-bit operand allows.
+    // The operand indexes the chunk's far_jumps table instead, see FarJump.
+    OP_JUMP_FAR,
+    OP_JUMP_IF_FALSE_FAR,
+    OP_LOOP_FAR,
+    // Ops taking their right operand as an immediate: a small integer, or the index of a number constant.
+    OP_ADD_SMALL,
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_SMALL,
+    OP_SUBTRACT_CONSTANT,
+    OP_LESS_SMALL,
+    OP_LESS_CONSTANT,
+    OP_LESS_EQUAL_SMALL,
+    OP_LESS_EQUAL_CONSTANT,
+    OP_GREATER_SMALL,
+    OP_GREATER_CONSTANT,
+    OP_GREATER_EQUAL_SMALL,
+    OP_GREATER_EQUAL_CONSTANT,
+    // Register ops, emitted by the register backend. They name frame slots directly
+    // instead of going through the value stack; see RK_CONSTANT for source operands.
+    OP_REG_MOVE,
+    OP_REG_ADD,
+    OP_REG_SUBTRACT,
+    OP_REG_MULTIPLY,
+    OP_REG_DIVIDE,
+    OP_REG_JUMP_UNLESS_EQUAL,
+    OP_REG_JUMP_UNLESS_NOT_EQUAL,
+    OP_REG_JUMP_UNLESS_GREATER,
+    OP_REG_JUMP_UNLESS_GREATER_EQUAL,
+    OP_REG_JUMP_UNLESS_LESS,
+    OP_REG_JUMP_UNLESS_LESS_EQUAL,
+    OP_REG_JUMP_UNLESS_FAR,
+    // Superinstructions, written over a recurring sequence by peephole.c.
+    // Each keeps the length of the sequence it replaces and reads its operands from the original positions.
+    OP_ADD_LOCAL_LOCAL,
+    OP_GET_LOCAL_PROPERTY,
+    OP_LESS_LOCAL_LOCAL_JUMP,
+    OP_LESS_LOCAL_SMALL_JUMP,
+    OP_LESS_LOCAL_CONSTANT_JUMP,
+    // Quickened forms, which run() writes over a generic instruction once it has seen the operand types,
+    // and rewrites back when their guard fails. Each has the length and operands of its generic form.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_GET_PROPERTY_CACHED,
 } OP_CODE;
 
+// A register op source operand is a frame slot, or a constant index when this bit is set.
+#define RK_CONSTANT 0x80
+
+// After OP_WIDE the first operand of the instruction takes 3 bytes, big-endian, instead of 1.
+// OP_CLOSURE also widens the slot or upvalue index of every capture.
+#define WIDE_OPERAND_MAX 0xffffff
+
+// What each capture of OP_CLOSURE takes, in its first byte: an upvalue of the enclosing closure, an upvalue for a
+// slot of the enclosing frame, or nothing, for a slot the closure reads with OP_GET_ENCLOSING instead.
+#define CAPTURE_UPVALUE 0
+#define CAPTURE_LOCAL 1
+#define CAPTURE_FRAME 2
+
+struct ObjClass;
+struct ObjClosure;
+struct ObjShape;
+
+#define INLINE_CACHE_WAYS 4
+
+typedef struct {
+    struct ObjClass *klass;
+    // the klass->version the method was looked up at.
+    uint32_t version;
+    struct ObjClosure *method;
+} InlineCacheEntry;
+
+// The methods an OP_INVOKE or OP_SUPER_INVOKE call site resolved to, by class, most recent first.
+typedef struct {
+    InlineCacheEntry entries[INLINE_CACHE_WAYS];
+} InlineCache;
+
+// Where an OP_GET_PROPERTY site last found its field: instances with this shape keep it at slot.
+typedef struct {
+    struct ObjShape *shape;
+    int slot;
+} PropertyCache;
+
+typedef struct {
+    // the distance jumped, measured from the end of the jump instruction.
+    int offset;
+    // the op the jump was emitted as, which tells OP_REG_JUMP_UNLESS_FAR which comparison to run.
+    uint8_t instruction;
+} FarJump;
 
 typedef struct {
     int count;
@@ -57,6 +158,15 @@ typedef struct {
     uint8_t *code;
     int *lines;
     ValueArray constants;
+    int far_jump_count;
+    int far_jump_capacity;
+    FarJump *far_jumps;
+    int inline_cache_count;
+    int inline_cache_capacity;
+    InlineCache *inline_caches;
+    int property_cache_count;
+    int property_cache_capacity;
+    PropertyCache *property_caches;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
@@ -67,4 +177,20 @@ void free_chunk(Chunk *chunk);
 
 int add_constant(Chunk *chunk, Value val);
 
+int add_far_jump(Chunk *chunk, int offset, uint8_t instruction);
+
+int add_inline_cache(Chunk *chunk);
+
+int add_property_cache(Chunk *chunk);
+
+int instruction_length(Chunk *chunk, int offset);
+
+int jump_target(Chunk *chunk, int offset);
+
+int stack_effect(Chunk *chunk, int offset);
+
+static inline int read_wide_operand(const uint8_t *code) {
+    return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
 #endif //C_LOX_CHUNK_H
@@ -15,11 +15,27 @@
 // uncomment it to trace execution
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// uncomment it to list the superinstructions the peephole pass fused in each chunk
+// #define DEBUG_PRINT_FUSIONS
+// uncomment it to report the loops the JIT traces, and the recordings it gives up on
+// #define DEBUG_PRINT_TRACES
 
 // #define DEBUG_STRESS_GC
 // uncomment to trace GC
 //#define DEBUG_LOG_GC
 
+// COMPUTED_GOTO is set by the CLOX_COMPUTED_GOTO CMake option.
+// Threaded dispatch relies on the "labels as values" extension, so fall back to the switch elsewhere.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+// JIT is set by the CLOX_JIT CMake option.
+// The JIT emits x86-64 code and unboxes NaN-boxed values, so it is left out of any other build.
+#if defined(JIT) && !(defined(__x86_64__) && defined(NAN_BOXING))
+#undef JIT
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif //C_LOX_COMMON_H
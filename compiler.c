@@ -10,8 +10,10 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "peephole.h"
+#include "vm.h"
 
-#ifdef DEBUG_PRINT_CODE
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_PRINT_FUSIONS)
 
 #include "debug.h"
 
@@ -44,10 +46,15 @@ typedef struct {
     Token name;
     int depth;
     bool is_captured;
+    // where the OP_CLOSURE of a local function declaration is, or -1 for any other local.
+    int closure;
+    // whether the function may outlive the frame, which it can't if every use of the local is a call,
+    // see bind_to_frame().
+    bool escapes;
 } Local;
 
 typedef struct {
-    uint8_t index;
+    int index;
     bool is_local;
 } Upvalue;
 
@@ -63,12 +70,15 @@ typedef struct {
     ObjFunction *function;
     FunctionType type;
 
-    // TODO: allow more than 256 local variables to be in scope at a time.
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int local_count;
-    Upvalue upvalues[UINT8_COUNT];
+    int local_capacity;
+    Upvalue *upvalues;
+    int upvalue_capacity;
 
     int scope_depth;
+    // the local of the enclosing compiler a local function declaration is compiling the function for, or -1.
+    int declared_local;
 } Compiler;
 
 typedef struct {
@@ -76,6 +86,12 @@ typedef struct {
     Token previous;
     bool had_error;
     bool panic_mode;
+    // where the code of the left operand of the infix expression being compiled starts.
+    int left_operand_start;
+    // where the code of the last call compiled starts, for a return to turn into a tail call.
+    int last_call;
+    // whether the callee of the call being compiled is a local function declaration.
+    bool calling_local_function;
 } parser;
 
 typedef struct ClassCompiler {
@@ -89,6 +105,8 @@ ClassCompiler *current_class_compiler = NULL;
 
 Compiler *current_compiler = NULL;
 
+Backend current_backend = BACKEND_STACK;
+
 static Chunk *current_chunk() {
     return &current_compiler->function->chunk;
 }
@@ -164,23 +182,89 @@ static void emit_bytes(uint8_t b1, uint8_t b2) {
     emit_byte(b2);
 }
 
-static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
+/**
+ * Emits instruction with operand as its first operand, behind OP_WIDE if it doesn't fit in a byte.
+ */
+static void emit_operand(uint8_t instruction, int operand) {
+    if (operand <= UINT8_MAX) {
+        emit_bytes(instruction, (uint8_t) operand);
+        return;
+    }
+
+    emit_bytes(OP_WIDE, instruction);
+    emit_byte((operand >> 16) & 0xff);
+    emit_bytes((operand >> 8) & 0xff, operand & 0xff);
+}
 
-    int offset = current_chunk()->count - loop_start + 2;
+/**
+ * Adds a jump over offset bytes to the far-jump table, returning the index the jump's operand holds instead.
+ */
+static int far_jump(int offset, uint8_t instruction) {
+    int index = add_far_jump(current_chunk(), offset, instruction);
+    if (index > UINT16_MAX) {
+        error("Too many far jumps in one chunk.");
+    }
+
+    return index;
+}
+
+static uint8_t far_jump_op(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+            return OP_JUMP_FAR;
+        case OP_JUMP_IF_FALSE:
+            return OP_JUMP_IF_FALSE_FAR;
+        case OP_LOOP:
+            return OP_LOOP_FAR;
+        default:
+            return OP_REG_JUMP_UNLESS_FAR;
+    }
+}
+
+static void emit_loop(int loop_start) {
+    int offset = current_chunk()->count - loop_start + 3;
+    uint8_t instruction = OP_LOOP;
     if (offset > UINT16_MAX) {
-        error("Loop body too large.");
+        offset = far_jump(offset, OP_LOOP);
+        instruction = OP_LOOP_FAR;
     }
 
+    emit_byte(instruction);
     emit_byte((offset >> 8) & 0xff);
     emit_byte(offset & 0xff);
 }
 
+/**
+ * Emits a forward jump to be patched later, returning the offset of the instruction.
+ */
 static int emit_jump(uint8_t instruction) {
     emit_byte(instruction);
-    emit_byte(0xff);
-    emit_byte(0xff);
-    return current_chunk()->count - 2;
+    emit_bytes(0xff, 0xff);
+    return current_chunk()->count - 3;
+}
+
+/**
+ * Emits the index of a new inline cache, the last operand of a method call.
+ */
+static void emit_inline_cache() {
+    int cache = add_inline_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many method calls in one chunk.");
+    }
+
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+/**
+ * Emits the index of a new property cache, the last operand of a property read.
+ */
+static void emit_property_cache() {
+    int cache = add_property_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property reads in one chunk.");
+    }
+
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
 }
 
 static void emit_return() {
@@ -194,41 +278,221 @@ static void emit_return() {
     emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Value val) {
+static int make_constant(Value val) {
     int constant = add_constant(current_chunk(), val);
-    // TODO: increase constant size to 2 bytes
-    if (constant > UINT8_MAX) {
+    if (constant > WIDE_OPERAND_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    return constant;
 }
 
 static void emit_constant(Value val) {
-    emit_bytes(OP_CONSTANT, make_constant(val));
+    emit_operand(OP_CONSTANT, make_constant(val));
 }
 
+/**
+ * Points the jump instruction at offset to the end of the chunk.
+ */
 static void patch_jump(int offset) {
-    // operand for how much to offset the ip
-
-    // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = current_chunk()->count - offset - 2;
+    Chunk *chunk = current_chunk();
+    // the jump offset is the last operand of every jump, and counts from the end of the instruction.
+    int operand = offset + instruction_length(chunk, offset) - 2;
+    int jump = chunk->count - operand - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        // the jump operand holds a far-jump table index instead; the instruction keeps its length.
+        jump = far_jump(jump, chunk->code[offset]);
+        chunk->code[offset] = far_jump_op(chunk->code[offset]);
     }
 
-    current_chunk()->code[offset] = (jump >> 8) & 0xff;
-    current_chunk()->code[offset + 1] = jump & 0xff;
+    chunk->code[operand] = (jump >> 8) & 0xff;
+    chunk->code[operand + 1] = jump & 0xff;
+}
+
+/**
+ * Reads the single GET_LOCAL or CONSTANT instruction at offset as a register op source operand.
+ */
+static bool register_operand(int offset, uint8_t *operand) {
+    uint8_t *code = current_chunk()->code;
+    if (code[offset + 1] >= RK_CONSTANT) {
+        return false;
+    }
+
+    switch (code[offset]) {
+        case OP_GET_LOCAL:
+            *operand = code[offset + 1];
+            return true;
+        case OP_CONSTANT:
+            *operand = code[offset + 1] | RK_CONSTANT;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Maps an op taking its right operand from the constant table to the stack op it stands for.
+ */
+static uint8_t constant_operand_op(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD_CONSTANT:
+            return OP_ADD;
+        case OP_SUBTRACT_CONSTANT:
+            return OP_SUBTRACT;
+        case OP_LESS_CONSTANT:
+            return OP_LESS;
+        case OP_LESS_EQUAL_CONSTANT:
+            return OP_LESS_EQUAL;
+        case OP_GREATER_CONSTANT:
+            return OP_GREATER;
+        case OP_GREATER_EQUAL_CONSTANT:
+            return OP_GREATER_EQUAL;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Decodes the code in [start, end) as `lhs op rhs` over register operands,
+ * either as operand, operand, op or as operand followed by an op with a constant operand.
+ */
+static bool register_binary(int start, int end, uint8_t *op, uint8_t *lhs, uint8_t *rhs) {
+    uint8_t *code = current_chunk()->code;
+    if (!register_operand(start, lhs)) {
+        return false;
+    }
+
+    if (end - start == 5 && register_operand(start + 2, rhs)) {
+        *op = code[start + 4];
+        return true;
+    }
+
+    if (end - start == 4 && code[start + 3] < RK_CONSTANT) {
+        *op = constant_operand_op(code[start + 2]);
+        *rhs = code[start + 3] | RK_CONSTANT;
+        return *op != 0;
+    }
+
+    return false;
+}
+
+static uint8_t register_arithmetic_op(uint8_t instruction) {
+    switch (instruction) {
+        case OP_ADD:
+            return OP_REG_ADD;
+        case OP_SUBTRACT:
+            return OP_REG_SUBTRACT;
+        case OP_MULTIPLY:
+            return OP_REG_MULTIPLY;
+        case OP_DIVIDE:
+            return OP_REG_DIVIDE;
+        default:
+            return 0;
+    }
 }
 
+/**
+ * Rewrites the expression statement compiled since start into a single register op when it is
+ * `local = operand` or `local = operand op operand`, where each operand is a local or a constant.
+ * Returns false if the statement doesn't have that shape and still needs its OP_POP.
+ */
+static bool lower_assignment(int start) {
+    if (current_backend != BACKEND_REGISTER) {
+        return false;
+    }
+
+    Chunk *chunk = current_chunk();
+    int length = chunk->count - start;
+    if (length < 4 || chunk->code[chunk->count - 2] != OP_SET_LOCAL) {
+        return false;
+    }
+
+    uint8_t dst = chunk->code[chunk->count - 1];
+    uint8_t lhs, rhs, op;
+
+    if (length == 4 && register_operand(start, &lhs)) {
+        chunk->count = start;
+        emit_byte(OP_REG_MOVE);
+        emit_bytes(dst, lhs);
+        return true;
+    }
+
+    if (register_binary(start, chunk->count - 2, &op, &lhs, &rhs) && (op = register_arithmetic_op(op)) != 0) {
+        chunk->count = start;
+        emit_bytes(op, dst);
+        emit_bytes(lhs, rhs);
+        return true;
+    }
+
+    return false;
+}
+
+static uint8_t register_branch_op(uint8_t compare, bool negated) {
+    switch (compare) {
+        case OP_EQUAL:
+            return negated ? OP_REG_JUMP_UNLESS_NOT_EQUAL : OP_REG_JUMP_UNLESS_EQUAL;
+        case OP_NOT_EQUAL:
+            return negated ? OP_REG_JUMP_UNLESS_EQUAL : OP_REG_JUMP_UNLESS_NOT_EQUAL;
+        case OP_GREATER:
+            return negated ? OP_REG_JUMP_UNLESS_LESS_EQUAL : OP_REG_JUMP_UNLESS_GREATER;
+        case OP_GREATER_EQUAL:
+            return negated ? OP_REG_JUMP_UNLESS_LESS : OP_REG_JUMP_UNLESS_GREATER_EQUAL;
+        case OP_LESS:
+            return negated ? OP_REG_JUMP_UNLESS_GREATER_EQUAL : OP_REG_JUMP_UNLESS_LESS;
+        case OP_LESS_EQUAL:
+            return negated ? OP_REG_JUMP_UNLESS_GREATER : OP_REG_JUMP_UNLESS_LESS_EQUAL;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Emits the jump taken when the condition compiled since start is false.
+ * In the register backend a comparison of two locals or constants becomes a single compare-and-branch
+ * that leaves nothing on the stack; otherwise the condition stays on the stack for OP_JUMP_IF_FALSE
+ * and *needs_pop is set so the caller pops it on the false path as well.
+ */
+static int emit_condition_jump(int start, bool *needs_pop) {
+    if (current_backend == BACKEND_REGISTER) {
+        Chunk *chunk = current_chunk();
+        int end = chunk->count;
+        bool negated = chunk->code[end - 1] == OP_NOT;
+        if (negated) {
+            end--;
+        }
+
+        uint8_t lhs, rhs, op;
+        if (register_binary(start, end, &op, &lhs, &rhs) && (op = register_branch_op(op, negated)) != 0) {
+            chunk->count = start;
+            emit_bytes(op, lhs);
+            emit_bytes(rhs, 0xff);
+            emit_byte(0xff);
+            *needs_pop = false;
+            return start;
+        }
+    }
+
+    *needs_pop = true;
+    int jump = emit_jump(OP_JUMP_IF_FALSE);
+    emit_byte(OP_POP);
+    return jump;
+}
+
+static void add_local(Token name);
+
 static void init_compiler(Compiler *compiler, FunctionType type) {
     compiler->enclosing = (struct Compiler *) current_compiler;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->upvalues = NULL;
+    compiler->upvalue_capacity = 0;
     compiler->scope_depth = 0;
+    compiler->declared_local = -1;
     compiler->function = new_function();
 
     current_compiler = compiler;
@@ -238,25 +502,172 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
 
     // From now on, the compiler implicitly claims stack slot zero for the VM’s own internal use.
     // We give it an empty name so that the user can’t write an identifier that refers to it.
-    Local *local = &current_compiler->locals[current_compiler->local_count++];
-    local->depth = 0;
-    local->is_captured = false;
+    Token name;
     if (type != TYPE_FUNCTION) {
-        local->name.start = "this";
-        local->name.length = 4;
+        name.start = "this";
+        name.length = 4;
     } else {
-        local->name.start = "";
-        local->name.length = 0;
+        name.start = "";
+        name.length = 0;
+    }
+    add_local(name);
+    current_compiler->locals[0].depth = 0;
+}
+
+/**
+ * Lets the function of a local declaration that never escapes read the slots it captures straight from the frame
+ * declaring it, which outlives it: every use of the local was a call, from that frame or from the function itself.
+ * Its OP_GET_UPVALUE and OP_SET_UPVALUE of those slots become OP_GET_ENCLOSING and OP_SET_ENCLOSING, and the
+ * OP_CLOSURE creating it no longer allocates upvalues for them, see CAPTURE_FRAME.
+ */
+static void bind_to_frame(Local *local) {
+    Chunk *chunk = current_chunk();
+    uint8_t *code = chunk->code + local->closure;
+    bool wide = code[0] == OP_WIDE;
+    int constant = wide ? read_wide_operand(code + 2) : code[1];
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    uint8_t *captures = code + (wide ? 5 : 2);
+    int capture_length = wide ? 4 : 2;
+
+    // the frame slot each upvalue reads directly, or -1 for one staying an upvalue.
+    int *slots = ALLOCATE(int, function->upvalue_count);
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        uint8_t *capture = captures + i * capture_length;
+        int slot = wide ? read_wide_operand(capture + 1) : capture[1];
+        // a narrow OP_GET_UPVALUE has no room for a wider slot.
+        slots[i] = capture[0] == CAPTURE_LOCAL && slot <= UINT8_MAX ? slot : -1;
+    }
+
+    // a closure the function creates may capture one of its upvalues, which then has to exist.
+    Chunk *body = &function->chunk;
+    for (int offset = 0; offset < body->count; offset += instruction_length(body, offset)) {
+        uint8_t *instruction = body->code + offset;
+        bool wide_closure = instruction[0] == OP_WIDE && instruction[1] == OP_CLOSURE;
+        if (instruction[0] != OP_CLOSURE && !wide_closure) {
+            continue;
+        }
+
+        Value inner = body->constants.values[wide_closure ? read_wide_operand(instruction + 2) : instruction[1]];
+        uint8_t *capture = instruction + (wide_closure ? 5 : 2);
+        for (int i = 0; i < AS_FUNCTION(inner)->upvalue_count; ++i) {
+            if (capture[0] == CAPTURE_UPVALUE) {
+                slots[wide_closure ? read_wide_operand(capture + 1) : capture[1]] = -1;
+            }
+            capture += wide_closure ? 4 : 2;
+        }
+    }
+
+    for (int offset = 0; offset < body->count; offset += instruction_length(body, offset)) {
+        uint8_t *instruction = body->code + offset;
+        if (instruction[0] == OP_WIDE) {
+            int slot;
+            if ((instruction[1] == OP_GET_UPVALUE || instruction[1] == OP_SET_UPVALUE) &&
+                (slot = slots[read_wide_operand(instruction + 2)]) != -1) {
+                instruction[1] = instruction[1] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+                instruction[2] = (slot >> 16) & 0xff;
+                instruction[3] = (slot >> 8) & 0xff;
+                instruction[4] = slot & 0xff;
+            }
+        } else if ((instruction[0] == OP_GET_UPVALUE || instruction[0] == OP_SET_UPVALUE) &&
+                   slots[instruction[1]] != -1) {
+            instruction[1] = slots[instruction[1]];
+            instruction[0] = instruction[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+        }
+    }
+
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        if (slots[i] != -1) {
+            captures[i * capture_length] = CAPTURE_FRAME;
+        }
+    }
+    FREE_ARRAY(int, slots, function->upvalue_count);
+}
+
+/**
+ * Called as local goes out of scope, when all of its uses are known.
+ */
+static void end_local(Local *local) {
+    if (local->closure != -1 && !local->escapes && !global_parser.had_error) {
+        bind_to_frame(local);
+    }
+}
+
+/**
+ * Returns the most values the frame of the function being compiled holds at once, following the stack effect of each
+ * instruction along every path through its chunk. Every path reaches an instruction with the same depth, so each
+ * instruction is visited once.
+ */
+static int measure_stack(ObjFunction *function) {
+    Chunk *chunk = current_chunk();
+    // the depth each instruction starts at, -1 until a path reaches it.
+    int *depths = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; ++i) {
+        depths[i] = -1;
+    }
+    // the jump targets left to follow.
+    int *pending = ALLOCATE(int, chunk->count);
+    int pending_count = 0;
+
+    // the closure and its arguments.
+    int max = function->arity + 1;
+    depths[0] = max;
+    pending[pending_count++] = 0;
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        for (;;) {
+            uint8_t instruction = chunk->code[offset];
+            int depth = depths[offset] + stack_effect(chunk, offset);
+            if (depth > max) {
+                max = depth;
+            }
+            if (instruction == OP_RETURN) {
+                break;
+            }
+
+            int target = jump_target(chunk, offset);
+            if (target >= 0 && depths[target] < 0) {
+                depths[target] = depth;
+                pending[pending_count++] = target;
+            }
+            if (instruction == OP_JUMP || instruction == OP_JUMP_FAR ||
+                instruction == OP_LOOP || instruction == OP_LOOP_FAR) {
+                break;
+            }
+
+            offset += instruction_length(chunk, offset);
+            if (offset >= chunk->count || depths[offset] >= 0) {
+                break;
+            }
+            depths[offset] = depth;
+        }
     }
+
+    FREE_ARRAY(int, pending, chunk->count);
+    FREE_ARRAY(int, depths, chunk->count);
+    return max;
 }
 
 static ObjFunction *end_compiler() {
     emit_return();
     ObjFunction *function = current_compiler->function;
+    for (int i = current_compiler->local_count - 1; i > 0; --i) {
+        end_local(&current_compiler->locals[i]);
+    }
+    FREE_ARRAY(Local, current_compiler->locals, current_compiler->local_capacity);
+    FREE_ARRAY(Upvalue, current_compiler->upvalues, current_compiler->upvalue_capacity);
+    if (!global_parser.had_error) {
+        function->stack_size = measure_stack(function);
+        fuse_superinstructions(current_chunk());
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!global_parser.had_error) {
         disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
     }
+#endif
+#ifdef DEBUG_PRINT_FUSIONS
+    if (!global_parser.had_error) {
+        disassemble_fusions(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+    }
 #endif
     current_compiler = (Compiler *) current_compiler->enclosing;
     return function;
@@ -272,6 +683,7 @@ static void end_scope() {
     while (current_compiler->local_count > 0 &&
            current_compiler->locals[current_compiler->local_count - 1].depth > current_compiler->scope_depth) {
         Local *local = &current_compiler->locals[current_compiler->local_count - 1];
+        end_local(local);
         if (current_compiler->locals[current_compiler->local_count - 1].is_captured) {
             emit_byte(OP_CLOSE_UPVALUE);
         } else {
@@ -291,10 +703,23 @@ static parse_rule *get_rule(TokenType type);
 
 static void parse_precedence(Precedence precedence);
 
-static uint8_t identifier_constant(Token *name) {
+static int identifier_constant(Token *name) {
     return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
+/**
+ * Resolves name to its global slot, so global accesses index vm.global_values instead of hashing the name.
+ */
+static int global_variable(Token *name) {
+    int slot = global_slot(copy_string(name->start, name->length));
+    if (slot > WIDE_OPERAND_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
 static bool identifiers_equal(Token *a, Token *b) {
     if (a->length != b->length) {
         return false;
@@ -318,7 +743,7 @@ static int resolve_local(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Compiler *compiler, int index, bool is_local) {
     int upvalue_count = compiler->function->upvalue_count;
     for (int i = 0; i < upvalue_count; ++i) {
         Upvalue *upvalue = &compiler->upvalues[i];
@@ -327,11 +752,17 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
         }
     }
 
-    if (upvalue_count == UINT8_COUNT) {
+    if (upvalue_count > WIDE_OPERAND_MAX) {
         error("Too many closure variables in function.");
         return 0;
     }
 
+    if (compiler->upvalue_capacity < upvalue_count + 1) {
+        int old_capacity = compiler->upvalue_capacity;
+        compiler->upvalue_capacity = GROW_CAPACITY(old_capacity);
+        compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, old_capacity, compiler->upvalue_capacity);
+    }
+
     compiler->upvalues[upvalue_count].is_local = is_local;
     compiler->upvalues[upvalue_count].index = index;
     return compiler->function->upvalue_count++;
@@ -345,28 +776,42 @@ static int resolve_upvalue(Compiler *compiler, Token *name) {
     int local = resolve_local((Compiler *) compiler->enclosing, name);
     if (local != -1) {
         ((Compiler *) (compiler->enclosing))->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t) local, true);
+        return add_upvalue(compiler, local, true);
     }
 
     int upvalue = resolve_upvalue((Compiler *) compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8_t) upvalue, false);
+        return add_upvalue(compiler, upvalue, false);
     }
 
     return -1;
 }
 
 static void add_local(Token name) {
-    if (current_compiler->local_count == UINT8_COUNT) {
+    if (current_compiler->local_count > WIDE_OPERAND_MAX) {
         error("Too many local variables in function.");
         return;
     }
 
+    if (current_compiler->local_capacity < current_compiler->local_count + 1) {
+        int old_capacity = current_compiler->local_capacity;
+        current_compiler->local_capacity = GROW_CAPACITY(old_capacity);
+        current_compiler->locals = GROW_ARRAY(Local, current_compiler->locals, old_capacity,
+                                              current_compiler->local_capacity);
+    }
+
+    ObjFunction *function = current_compiler->function;
+    if (current_compiler->local_count + 1 > function->slot_count) {
+        function->slot_count = current_compiler->local_count + 1;
+    }
+
     Local *local = &current_compiler->locals[current_compiler->local_count++];
     local->name = name;
     // set depth to -1 to point out the local is uninitialized.
     local->depth = -1;
     local->is_captured = false;
+    local->closure = -1;
+    local->escapes = false;
 }
 
 static void declare_variable() {
@@ -390,7 +835,7 @@ static void declare_variable() {
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char *error_message) {
+static int parse_variable(const char *error_message) {
     consume(TOKEN_IDENTIFIER, error_message);
 
     declare_variable();
@@ -398,8 +843,7 @@ static uint8_t parse_variable(const char *error_message) {
         return 0;
     }
 
-
-    return identifier_constant(&global_parser.previous);
+    return global_variable(&global_parser.previous);
 }
 
 static void mark_initialized() {
@@ -410,13 +854,13 @@ static void mark_initialized() {
     current_compiler->locals[current_compiler->local_count - 1].depth = current_compiler->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(int global) {
     if (current_compiler->scope_depth > 0) {
         mark_initialized();
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_operand(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list() {
@@ -440,14 +884,113 @@ static void and_(bool can_assign) {
     patch_jump(end_jump);
 }
 
+static bool number_literal(int start, int end) {
+    Chunk *chunk = current_chunk();
+    return end - start == 2 && chunk->code[start] == OP_CONSTANT &&
+           IS_NUMBER(chunk->constants.values[chunk->code[start + 1]]);
+}
+
+/**
+ * Returns the op applying operator_type to a number on the stack and an immediate,
+ * a small integer or a constant index, or -1 if operator_type has no such form.
+ */
+static int immediate_op(TokenType operator_type, bool small) {
+    switch (operator_type) {
+        case TOKEN_PLUS:
+            return small ? OP_ADD_SMALL : OP_ADD_CONSTANT;
+        case TOKEN_MINUS:
+            return small ? OP_SUBTRACT_SMALL : OP_SUBTRACT_CONSTANT;
+        case TOKEN_LESS:
+            return small ? OP_LESS_SMALL : OP_LESS_CONSTANT;
+        case TOKEN_LESS_EQUAL:
+            return small ? OP_LESS_EQUAL_SMALL : OP_LESS_EQUAL_CONSTANT;
+        case TOKEN_GREATER:
+            return small ? OP_GREATER_SMALL : OP_GREATER_CONSTANT;
+        case TOKEN_GREATER_EQUAL:
+            return small ? OP_GREATER_EQUAL_SMALL : OP_GREATER_EQUAL_CONSTANT;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * The operator giving the same result with its operands swapped, or TOKEN_ERROR if there is none.
+ */
+static TokenType mirrored_operator(TokenType operator_type) {
+    switch (operator_type) {
+        case TOKEN_PLUS:
+            return TOKEN_PLUS;
+        case TOKEN_LESS:
+            return TOKEN_GREATER;
+        case TOKEN_LESS_EQUAL:
+            return TOKEN_GREATER_EQUAL;
+        case TOKEN_GREATER:
+            return TOKEN_LESS;
+        case TOKEN_GREATER_EQUAL:
+            return TOKEN_LESS_EQUAL;
+        default:
+            return TOKEN_ERROR;
+    }
+}
+
+/**
+ * When one operand of a binary operator is a number literal, drops its OP_CONSTANT and
+ * folds the number into the operator instead: as the operand itself if it is a small integer,
+ * otherwise as its constant index. Returns false if neither operand is a literal.
+ */
+static bool emit_immediate_op(TokenType operator_type, int left_start, int right_start) {
+    Chunk *chunk = current_chunk();
+    uint8_t constant;
+
+    if (number_literal(right_start, chunk->count) && immediate_op(operator_type, false) != -1) {
+        constant = chunk->code[right_start + 1];
+        chunk->count = right_start;
+    } else if (number_literal(left_start, right_start) && mirrored_operator(operator_type) != TOKEN_ERROR &&
+               immediate_op(mirrored_operator(operator_type), false) != -1) {
+        // a literal has no side effects, so the right operand may as well run first.
+        constant = chunk->code[left_start + 1];
+        int right_length = chunk->count - right_start;
+        memmove(chunk->code + left_start, chunk->code + right_start, right_length);
+        memmove(chunk->lines + left_start, chunk->lines + right_start, right_length * sizeof(int));
+        chunk->count = left_start + right_length;
+        operator_type = mirrored_operator(operator_type);
+    } else {
+        return false;
+    }
+
+    // the register backend reads constant operands straight from the table, so it sticks to constant indexes.
+    double number = AS_NUMBER(chunk->constants.values[constant]);
+    bool small = current_backend == BACKEND_STACK && number >= 0 && number <= UINT8_MAX &&
+                 number == (double) (uint8_t) number;
+    if (small) {
+        if (constant == chunk->constants.count - 1) {
+            // nothing else refers to the literal's constant.
+            chunk->constants.count--;
+        }
+        emit_bytes(immediate_op(operator_type, true), (uint8_t) number);
+    } else {
+        emit_bytes(immediate_op(operator_type, false), constant);
+    }
+
+    return true;
+}
+
 static void binary(bool can_assign) {
     TokenType operator_type = global_parser.previous.type;
+    int left_start = global_parser.left_operand_start;
+    int right_start = current_chunk()->count;
     parse_rule *rule = get_rule(operator_type);
     parse_precedence((Precedence) (rule->precedence + 1));
+    // the value is the operator's now, and an immediate form may move the code of the operands.
+    global_parser.last_call = -1;
+
+    if (emit_immediate_op(operator_type, left_start, right_start)) {
+        return;
+    }
 
     switch (operator_type) {
         case TOKEN_BANG_EQUAL: {
-            emit_bytes(OP_EQUAL, OP_NOT);
+            emit_byte(OP_NOT_EQUAL);
             break;
         }
         case TOKEN_EQUAL_EQUAL: {
@@ -459,7 +1002,7 @@ static void binary(bool can_assign) {
             break;
         }
         case TOKEN_GREATER_EQUAL: {
-            emit_bytes(OP_LESS, OP_NOT);
+            emit_byte(OP_GREATER_EQUAL);
             break;
         }
         case TOKEN_LESS: {
@@ -467,7 +1010,7 @@ static void binary(bool can_assign) {
             break;
         }
         case TOKEN_LESS_EQUAL: {
-            emit_bytes(OP_GREATER, OP_NOT);
+            emit_byte(OP_LESS_EQUAL);
             break;
         }
         case TOKEN_PLUS: {
@@ -493,24 +1036,31 @@ static void binary(bool can_assign) {
 }
 
 static void call(bool can_assign) {
+    bool local_function = global_parser.calling_local_function;
+    global_parser.calling_local_function = false;
     uint8_t arg_count = argument_list();
+    // a local function may read the frame calling it through OP_GET_ENCLOSING, which a tail call would take over.
+    global_parser.last_call = local_function ? -1 : current_chunk()->count;
     emit_bytes(OP_CALL, arg_count);
 }
 
 static void dot(bool can_assign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&global_parser.previous);
+    int name = identifier_constant(&global_parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_operand(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         // method call
         uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
+        global_parser.last_call = current_chunk()->count;
+        emit_operand(OP_INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_operand(OP_GET_PROPERTY, name);
+        emit_property_cache();
     }
 }
 
@@ -560,6 +1110,32 @@ static void string(bool can_assign) {
     emit_constant(OBJ_VAL(copy_string(global_parser.previous.start + 1, global_parser.previous.length - 2)));
 }
 
+/**
+ * Records a use of the local or upvalue arg of the current function for the local function declarations it may
+ * resolve to: one escapes on anything but a call from the function declaring it, or from its own body.
+ */
+static void track_local_function(uint8_t get_op, int arg, bool call) {
+    Compiler *compiler = current_compiler;
+    if (get_op == OP_GET_LOCAL) {
+        Local *local = &compiler->locals[arg];
+        local->escapes = local->escapes || !call;
+        global_parser.calling_local_function = call && local->closure != -1;
+        return;
+    }
+
+    // the upvalue comes down from the local some enclosing function captured.
+    bool own = call;
+    while (!compiler->upvalues[arg].is_local) {
+        arg = compiler->upvalues[arg].index;
+        compiler = (Compiler *) compiler->enclosing;
+        own = false;
+    }
+    int slot = compiler->upvalues[arg].index;
+    if (!own || compiler->declared_local != slot) {
+        ((Compiler *) compiler->enclosing)->locals[slot].escapes = true;
+    }
+}
+
 static void named_variable(Token name, bool can_assign) {
     uint8_t getOp, setOp;
     int arg = resolve_local(current_compiler, &name);
@@ -570,16 +1146,21 @@ static void named_variable(Token name, bool can_assign) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
+        arg = global_variable(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
+    bool assign = can_assign && match(TOKEN_EQUAL);
+    if (getOp != OP_GET_GLOBAL) {
+        track_local_function(getOp, arg, !assign && check(TOKEN_LEFT_PAREN));
+    }
+
+    if (assign) {
         expression();
-        emit_bytes(setOp, (uint8_t) arg);
+        emit_operand(setOp, arg);
     } else {
-        emit_bytes(getOp, (uint8_t) arg);
+        emit_operand(getOp, arg);
     }
 }
 
@@ -603,17 +1184,19 @@ static void super_(bool can_assign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(&global_parser.previous);
+    int name = identifier_constant(&global_parser.previous);
 
     named_variable(synthetic_token("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_SUPER_INVOKE, name);
+        emit_operand(OP_SUPER_INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
         named_variable(synthetic_token("super"), false);
-        emit_bytes(OP_GET_SUPER, name);
+        emit_operand(OP_GET_SUPER, name);
+        emit_inline_cache();
     }
 }
 
@@ -660,7 +1243,7 @@ parse_rule rules[] = {
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_NONE},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
     [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
@@ -703,7 +1286,12 @@ static void block() {
 
 static void function(FunctionType type) {
     Compiler compiler;
+    Compiler *enclosing = current_compiler;
     init_compiler(&compiler, type);
+    if (type == TYPE_FUNCTION && enclosing->scope_depth > 0) {
+        // fun_declaration() has just declared the local.
+        compiler.declared_local = enclosing->local_count - 1;
+    }
 
     // This beginScope() doesn’t have a corresponding endScope() call.
     // Because we end Compiler completely when we reach the end of the function body,
@@ -717,7 +1305,7 @@ static void function(FunctionType type) {
             if (current_compiler->function->arity > 255) {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
+            int constant = parse_variable("Expect parameter name.");
             define_variable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -725,34 +1313,59 @@ static void function(FunctionType type) {
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
     block();
 
+    Upvalue *upvalues = compiler.upvalues;
+    // end_compiler() frees the upvalues, keep them alive until they are emitted.
+    compiler.upvalues = NULL;
+    int upvalue_capacity = compiler.upvalue_capacity;
+    compiler.upvalue_capacity = 0;
+
     ObjFunction *fn = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(fn)));
+    int constant = make_constant(OBJ_VAL(fn));
+    bool wide = constant > UINT8_MAX;
+    for (int i = 0; i < fn->upvalue_count; ++i) {
+        wide = wide || upvalues[i].index > UINT8_MAX;
+    }
+
+    // a wide OP_CLOSURE widens the index of every capture along with the function constant.
+    if (wide) {
+        emit_bytes(OP_WIDE, OP_CLOSURE);
+        emit_byte((constant >> 16) & 0xff);
+        emit_bytes((constant >> 8) & 0xff, constant & 0xff);
+    } else {
+        emit_bytes(OP_CLOSURE, constant);
+    }
 
     for (int i = 0; i < fn->upvalue_count; ++i) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        emit_byte(upvalues[i].is_local ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
+        int index = upvalues[i].index;
+        if (wide) {
+            emit_bytes((index >> 16) & 0xff, (index >> 8) & 0xff);
+        }
+        emit_byte(index & 0xff);
     }
+
+    FREE_ARRAY(Upvalue, upvalues, upvalue_capacity);
 }
 
 static void compile_method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(&global_parser.previous);
+    int constant = identifier_constant(&global_parser.previous);
     FunctionType type = TYPE_METHOD;
     if (global_parser.previous.length == 4 && memcmp(global_parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_operand(OP_METHOD, constant);
 }
 
 static void class_declaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token class_name = global_parser.previous;
-    uint8_t name_constant = identifier_constant(&global_parser.previous);
+    int name_constant = identifier_constant(&global_parser.previous);
     declare_variable();
 
-    emit_bytes(OP_CLASS, name_constant);
-    define_variable(name_constant);
+    emit_operand(OP_CLASS, name_constant);
+    define_variable(current_compiler->scope_depth > 0 ? 0 : global_variable(&class_name));
 
     ClassCompiler class_compiler;
     class_compiler.has_superclass = false;
@@ -784,6 +1397,8 @@ static void class_declaration() {
         compile_method();
     }
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    // no methods are added after the body, so the class can resolve what it will always look up.
+    emit_byte(OP_SEAL);
     emit_byte(OP_POP);
 
     if (class_compiler.has_superclass) {
@@ -794,14 +1409,18 @@ static void class_declaration() {
 }
 
 static void fun_declaration() {
-    uint8_t global = parse_variable("Expect function name.");
+    int global = parse_variable("Expect function name.");
     mark_initialized();
+    int closure = current_chunk()->count;
     function(TYPE_FUNCTION);
+    if (current_compiler->scope_depth > 0) {
+        current_compiler->locals[current_compiler->local_count - 1].closure = closure;
+    }
     define_variable(global);
 }
 
 static void var_declaration() {
-    uint8_t global = parse_variable("Expect variable name.");
+    int global = parse_variable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -815,9 +1434,12 @@ static void var_declaration() {
 }
 
 static void expression_statement() {
+    int start = current_chunk()->count;
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emit_byte(OP_POP);
+    if (!lower_assignment(start)) {
+        emit_byte(OP_POP);
+    }
 }
 
 static void for_statement() {
@@ -834,14 +1456,14 @@ static void for_statement() {
 
     int loop_start = current_chunk()->count;
     int exit_jump = -1;
+    bool exit_needs_pop = false;
     // condition clause
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP); // pop condition
+        exit_jump = emit_condition_jump(loop_start, &exit_needs_pop);
     }
 
     // increment clause
@@ -849,7 +1471,9 @@ static void for_statement() {
         int body_jump = emit_jump(OP_JUMP);
         int increment_start = current_chunk()->count;
         expression();
-        emit_byte(OP_POP);
+        if (!lower_assignment(increment_start)) {
+            emit_byte(OP_POP);
+        }
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emit_loop(loop_start);
@@ -862,23 +1486,28 @@ static void for_statement() {
 
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP); // pop condition
+        if (exit_needs_pop) {
+            emit_byte(OP_POP); // pop condition
+        }
     }
     end_scope();
 }
 
 static void if_statement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int condition_start = current_chunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    bool needs_pop;
+    int then_jump = emit_condition_jump(condition_start, &needs_pop);
     statement();
     int else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
-    emit_byte(OP_POP);
+    if (needs_pop) {
+        emit_byte(OP_POP);
+    }
 
     if (match(TOKEN_ELSE)) {
         statement();
@@ -892,6 +1521,25 @@ static void print_statement() {
     emit_byte(OP_PRINT);
 }
 
+/**
+ * Turns a call the return value ends with into a tail call, which runs the callee in the frame of the function
+ * returning. The OP_RETURN stays behind it for the callees that don't take over the frame, and for any jump that
+ * skipped the call.
+ */
+static void tail_call() {
+    Chunk *chunk = current_chunk();
+    int call = global_parser.last_call;
+    if (call < 0 || call + instruction_length(chunk, call) != chunk->count) {
+        return;
+    }
+
+    uint8_t *code = &chunk->code[call];
+    if (code[0] == OP_WIDE) {
+        code++;
+    }
+    *code = *code == OP_CALL ? OP_TAIL_CALL : OP_TAIL_INVOKE;
+}
+
 static void return_statement() {
     if (current_compiler->type == TYPE_SCRIPT) {
         error("Can't return from top-level code.");
@@ -904,8 +1552,10 @@ static void return_statement() {
             error("Can't return a value from an initializer.");
         }
 
+        global_parser.last_call = -1;
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        tail_call();
         emit_byte(OP_RETURN);
     }
 }
@@ -916,13 +1566,15 @@ static void while_statement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    bool needs_pop;
+    int exit_jump = emit_condition_jump(loop_start, &needs_pop);
     statement();
     emit_loop(loop_start);
 
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    if (needs_pop) {
+        emit_byte(OP_POP);
+    }
 }
 
 static void synchronize() {
@@ -989,6 +1641,7 @@ static void statement() {
 
 
 static void parse_precedence(Precedence precedence) {
+    int start = current_chunk()->count;
     advance();
     ParseFn prefix_rule = get_rule(global_parser.previous.type)->prefix;
     if (prefix_rule == NULL) {
@@ -1002,6 +1655,7 @@ static void parse_precedence(Precedence precedence) {
     while (precedence <= get_rule(global_parser.current.type)->precedence) {
         advance();
         ParseFn infix_rule = get_rule(global_parser.previous.type)->infix;
+        global_parser.left_operand_start = start;
         infix_rule(can_assign);
     }
 
@@ -1016,6 +1670,10 @@ static parse_rule *get_rule(TokenType type) {
 }
 
 
+void set_backend(Backend backend) {
+    current_backend = backend;
+}
+
 ObjFunction *compile(const char *source) {
     init_scanner(source);
     Compiler compiler;
@@ -1024,6 +1682,7 @@ ObjFunction *compile(const char *source) {
 
     global_parser.had_error = false;
     global_parser.panic_mode = false;
+    global_parser.calling_local_function = false;
 
     advance();
     while (!match(TOKEN_EOF)) {
@@ -7,6 +7,13 @@
 
 #include "vm.h"
 
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+} Backend;
+
+void set_backend(Backend backend);
+
 ObjFunction *compile(const char *source);
 void mark_compiler_roots();
 
@@ -6,6 +6,8 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "peephole.h"
+#include "vm.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
@@ -34,6 +36,14 @@ static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset
     return offset + 3;
 }
 
+static int far_jump_instruction(const char *name, int sign, Chunk *chunk, int offset) {
+    uint16_t index = (uint16_t) (chunk->code[offset + 1] << 8);
+    index |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d (far %d)\n", name, offset,
+           offset + 3 + sign * chunk->far_jumps[index].offset, index);
+    return offset + 3;
+}
+
 static int constant_instruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
@@ -43,15 +53,198 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int global_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d '", name, slot);
+    print_value(vm.global_names.values[slot]);
+    printf("\n");
+
+    return offset + 2;
+}
+
 static int invoke_instruction(const char *name, Chunk *chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t arg_count = chunk->code[offset + 2];
+    int cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
     printf("%-16s (%d args) %4d", name, arg_count, constant);
     print_value(chunk->constants.values[constant]);
+    printf(" ic %d\n", cache);
+    return offset + 5;
+}
+
+static int cache_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf(" ic %d\n", cache);
+    return offset + 4;
+}
+
+static void print_register(uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        printf(" k%d", operand & ~RK_CONSTANT);
+    } else {
+        printf(" r%d", operand);
+    }
+}
+
+static int register_move_instruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s r%d =", name, chunk->code[offset + 1]);
+    print_register(chunk->code[offset + 2]);
     printf("\n");
     return offset + 3;
 }
 
+static int register_instruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s r%d =", name, chunk->code[offset + 1]);
+    print_register(chunk->code[offset + 2]);
+    print_register(chunk->code[offset + 3]);
+    printf("\n");
+    return offset + 4;
+}
+
+static int register_jump_instruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t jump = (uint16_t) (chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s", name);
+    print_register(chunk->code[offset + 1]);
+    print_register(chunk->code[offset + 2]);
+    printf(" %4d -> %d\n", offset, offset + 5 + jump);
+    return offset + 5;
+}
+
+static int register_far_jump_instruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t index = (uint16_t) (chunk->code[offset + 3] << 8);
+    index |= chunk->code[offset + 4];
+    printf("%-16s", name);
+    print_register(chunk->code[offset + 1]);
+    print_register(chunk->code[offset + 2]);
+    printf(" %4d -> %d (far %d)\n", offset, offset + 5 + chunk->far_jumps[index].offset, index);
+    return offset + 5;
+}
+
+static int closure_captures(Chunk *chunk, ObjFunction *function, int offset, bool wide) {
+    for (int j = 0; j < function->upvalue_count; ++j) {
+        int capture = chunk->code[offset++];
+        int index;
+        if (wide) {
+            index = read_wide_operand(chunk->code + offset);
+            offset += 3;
+        } else {
+            index = chunk->code[offset++];
+        }
+        printf("%04d      |                     %s %d\n", offset - (wide ? 4 : 2), capture == CAPTURE_LOCAL ? "local" : capture == CAPTURE_UPVALUE ? "upvalue" : "frame",
+               index);
+    }
+
+    return offset;
+}
+
+/**
+ * Disassembles an instruction behind OP_WIDE, printing the widened operand.
+ */
+static int wide_instruction(Chunk *chunk, int offset) {
+    uint8_t instruction = chunk->code[offset + 1];
+    int operand = read_wide_operand(chunk->code + offset + 2);
+    const char *name;
+    switch (instruction) {
+        case OP_GET_LOCAL:
+            printf("%-16s %4d\n", "OP_WIDE_GET_LOCAL", operand);
+            return offset + 5;
+        case OP_SET_LOCAL:
+            printf("%-16s %4d\n", "OP_WIDE_SET_LOCAL", operand);
+            return offset + 5;
+        case OP_GET_UPVALUE:
+            printf("%-16s %4d\n", "OP_WIDE_GET_UPVALUE", operand);
+            return offset + 5;
+        case OP_SET_UPVALUE:
+            printf("%-16s %4d\n", "OP_WIDE_SET_UPVALUE", operand);
+            return offset + 5;
+        case OP_GET_ENCLOSING:
+            printf("%-16s %4d\n", "OP_WIDE_GET_ENCLOSING", operand);
+            return offset + 5;
+        case OP_SET_ENCLOSING:
+            printf("%-16s %4d\n", "OP_WIDE_SET_ENCLOSING", operand);
+            return offset + 5;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+            name = instruction == OP_INVOKE ? "OP_WIDE_INVOKE"
+                   : instruction == OP_SUPER_INVOKE ? "OP_WIDE_SUPER_INVOKE" : "OP_WIDE_TAIL_INVOKE";
+            printf("%-16s (%d args) %4d '", name,
+                   chunk->code[offset + 5], operand);
+            print_value(chunk->constants.values[operand]);
+            printf(" ic %d\n", (chunk->code[offset + 6] << 8) | chunk->code[offset + 7]);
+            return offset + 8;
+        case OP_CLOSURE: {
+            printf("%-16s %4d ", "OP_WIDE_CLOSURE", operand);
+            print_value(chunk->constants.values[operand]);
+            printf("\n");
+            return closure_captures(chunk, AS_FUNCTION(chunk->constants.values[operand]), offset + 5, true);
+        }
+        case OP_CONSTANT:
+            name = "OP_WIDE_CONSTANT";
+            break;
+        case OP_GET_GLOBAL:
+            name = "OP_WIDE_GET_GLOBAL";
+            break;
+        case OP_DEFINE_GLOBAL:
+            name = "OP_WIDE_DEFINE_GLOBAL";
+            break;
+        case OP_SET_GLOBAL:
+            name = "OP_WIDE_SET_GLOBAL";
+            break;
+        case OP_SET_PROPERTY:
+            name = "OP_WIDE_SET_PROPERTY";
+            break;
+        case OP_GET_PROPERTY:
+        case OP_GET_SUPER:
+            printf("%-16s %4d '", instruction == OP_GET_PROPERTY ? "OP_WIDE_GET_PROPERTY" : "OP_WIDE_GET_SUPER", operand);
+            print_value(chunk->constants.values[operand]);
+            printf(" ic %d\n", (chunk->code[offset + 5] << 8) | chunk->code[offset + 6]);
+            return offset + 7;
+        case OP_CLASS:
+            name = "OP_WIDE_CLASS";
+            break;
+        case OP_METHOD:
+            name = "OP_WIDE_METHOD";
+            break;
+        default:
+            printf("Unknown wide opcode %d\n", instruction);
+            return offset + 5;
+    }
+
+    bool is_global = instruction == OP_GET_GLOBAL || instruction == OP_DEFINE_GLOBAL || instruction == OP_SET_GLOBAL;
+    printf("%-16s %4d '", name, operand);
+    // global operands are slots, not constants.
+    print_value(is_global ? vm.global_names.values[operand] : chunk->constants.values[operand]);
+    printf("\n");
+    return offset + 5;
+}
+
+static int add_local_local_instruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 3]);
+    return offset + 5;
+}
+
+static int local_property_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 3];
+    printf("%-16s %4d %4d '", name, chunk->code[offset + 1], constant);
+    print_value(chunk->constants.values[constant]);
+    printf(" ic %d\n", (chunk->code[offset + 4] << 8) | chunk->code[offset + 5]);
+    return offset + 6;
+}
+
+static int compare_jump_instruction(const char *name, Chunk *chunk, int offset) {
+    int length = instruction_length(chunk, offset);
+    uint16_t jump = (uint16_t) (chunk->code[offset + length - 2] << 8);
+    jump |= chunk->code[offset + length - 1];
+    printf("%-16s %4d %4d %4d -> %d\n", name, chunk->code[offset + 1], chunk->code[offset + 3], offset,
+           offset + length + jump);
+    return offset + length;
+}
+
 int disassemble_instruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
 
@@ -78,17 +271,21 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+            return global_instruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+            return global_instruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byte_instruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+        case OP_GET_ENCLOSING:
+            return byte_instruction("OP_GET_ENCLOSING", chunk, offset);
+        case OP_SET_ENCLOSING:
+            return byte_instruction("OP_SET_ENCLOSING", chunk, offset);
         case OP_GET_PROPERTY:
-            return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+            return cache_instruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
             return constant_instruction("OP_SET_PROPERTY", chunk, offset);
         case OP_EQUAL:
@@ -97,8 +294,18 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return simple_instruction("OP_GREATER", offset);
         case OP_LESS:
             return simple_instruction("OP_LESS", offset);
+        case OP_NOT_EQUAL:
+            return simple_instruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simple_instruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simple_instruction("OP_ADD", offset);
+        case OP_ADD_NUM:
+            return simple_instruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simple_instruction("OP_ADD_STR", offset);
         case OP_SUBTRACT:
             return simple_instruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
@@ -119,6 +326,8 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return jump_instruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byte_instruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -126,20 +335,15 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             print_value(chunk->constants.values[constant]);
             printf("\n");
 
-            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalue_count; ++j) {
-                int is_local = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
-            }
-
-            return offset;
+            return closure_captures(chunk, AS_FUNCTION(chunk->constants.values[constant]), offset, false);
         }
         case OP_CLOSE_UPVALUE: {
             return simple_instruction("OP_CLOSE_UPVALUE", offset);
         }
         case OP_GET_SUPER:
-            return constant_instruction("OP_GET_SUPER", chunk, offset);
+            return cache_instruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_PROPERTY_CACHED:
+            return cache_instruction("OP_GET_PROPERTY_CACHED", chunk, offset);
         case OP_SUPER_INVOKE:
             return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_RETURN:
@@ -150,10 +354,102 @@ int disassemble_instruction(Chunk *chunk, int offset) {
             return constant_instruction("OP_METHOD", chunk, offset);
         case OP_INVOKE:
             return invoke_instruction("OP_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_WIDE:
+            return wide_instruction(chunk, offset);
+        case OP_JUMP_FAR:
+            return far_jump_instruction("OP_JUMP_FAR", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_FAR:
+            return far_jump_instruction("OP_JUMP_IF_FALSE_FAR", 1, chunk, offset);
+        case OP_LOOP_FAR:
+            return far_jump_instruction("OP_LOOP_FAR", -1, chunk, offset);
+        case OP_REG_JUMP_UNLESS_FAR:
+            return register_far_jump_instruction("OP_REG_JUMP_UNLESS_FAR", chunk, offset);
         case OP_INHERIT:
             return simple_instruction("OP_INHERIT", offset);
+        case OP_SEAL:
+            return simple_instruction("OP_SEAL", offset);
+        case OP_ADD_SMALL:
+            return byte_instruction("OP_ADD_SMALL", chunk, offset);
+        case OP_ADD_CONSTANT:
+            return constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_SMALL:
+            return byte_instruction("OP_SUBTRACT_SMALL", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constant_instruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_LESS_SMALL:
+            return byte_instruction("OP_LESS_SMALL", chunk, offset);
+        case OP_LESS_CONSTANT:
+            return constant_instruction("OP_LESS_CONSTANT", chunk, offset);
+        case OP_LESS_EQUAL_SMALL:
+            return byte_instruction("OP_LESS_EQUAL_SMALL", chunk, offset);
+        case OP_LESS_EQUAL_CONSTANT:
+            return constant_instruction("OP_LESS_EQUAL_CONSTANT", chunk, offset);
+        case OP_GREATER_SMALL:
+            return byte_instruction("OP_GREATER_SMALL", chunk, offset);
+        case OP_GREATER_CONSTANT:
+            return constant_instruction("OP_GREATER_CONSTANT", chunk, offset);
+        case OP_GREATER_EQUAL_SMALL:
+            return byte_instruction("OP_GREATER_EQUAL_SMALL", chunk, offset);
+        case OP_GREATER_EQUAL_CONSTANT:
+            return constant_instruction("OP_GREATER_EQUAL_CONSTANT", chunk, offset);
+        case OP_REG_MOVE:
+            return register_move_instruction("OP_REG_MOVE", chunk, offset);
+        case OP_REG_ADD:
+            return register_instruction("OP_REG_ADD", chunk, offset);
+        case OP_REG_SUBTRACT:
+            return register_instruction("OP_REG_SUBTRACT", chunk, offset);
+        case OP_REG_MULTIPLY:
+            return register_instruction("OP_REG_MULTIPLY", chunk, offset);
+        case OP_REG_DIVIDE:
+            return register_instruction("OP_REG_DIVIDE", chunk, offset);
+        case OP_REG_JUMP_UNLESS_EQUAL:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_EQUAL", chunk, offset);
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_NOT_EQUAL", chunk, offset);
+        case OP_REG_JUMP_UNLESS_GREATER:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_GREATER", chunk, offset);
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_GREATER_EQUAL", chunk, offset);
+        case OP_REG_JUMP_UNLESS_LESS:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_LESS", chunk, offset);
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+            return register_jump_instruction("OP_REG_JUMP_UNLESS_LESS_EQUAL", chunk, offset);
+        case OP_ADD_LOCAL_LOCAL:
+            return add_local_local_instruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_PROPERTY:
+            return local_property_instruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+        case OP_LESS_LOCAL_LOCAL_JUMP:
+            return compare_jump_instruction("OP_LESS_LOCAL_LOCAL_JUMP", chunk, offset);
+        case OP_LESS_LOCAL_SMALL_JUMP:
+            return compare_jump_instruction("OP_LESS_LOCAL_SMALL_JUMP", chunk, offset);
+        case OP_LESS_LOCAL_CONSTANT_JUMP:
+            return compare_jump_instruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+/**
+ * Lists the superinstructions fused into chunk, followed by how often each fired.
+ */
+void disassemble_fusions(Chunk *chunk, const char *name) {
+    printf("== fusions in %s ==\n", name);
+
+    int fired[UINT8_COUNT] = {0};
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if (superinstruction_name(instruction) != NULL) {
+            fired[instruction]++;
+            disassemble_instruction(chunk, offset);
+        }
+    }
+
+    for (int instruction = 0; instruction < UINT8_COUNT; ++instruction) {
+        if (fired[instruction] > 0) {
+            printf("%-28s x %d\n", superinstruction_name(instruction), fired[instruction]);
+        }
+    }
+}
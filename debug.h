@@ -11,4 +11,6 @@ void disassemble_chunk(Chunk *chunk, const char *name);
 
 int disassemble_instruction(Chunk *chunk, int offset);
 
+void disassemble_fusions(Chunk *chunk, const char *name);
+
 #endif //C_LOX_DEBUG_H
@@ -0,0 +1,1383 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "object.h"
+#include "peephole.h"
+#include "trace.h"
+
+// A baseline compiler: every instruction becomes a fixed template of x86-64 code working on the VM's own stack,
+// with the number cases inline and everything else handed to a helper in vm.c.
+// Whenever an operand isn't what the template expects, the code exits to run() at the start of the instruction,
+// so run() is always free to take over a frame at any of its instructions, and to hand it back.
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// What the native code keeps in callee-saved registers while it runs a frame.
+#define FRAME RBX
+#define SLOTS R12
+#define STACK_TOP_ADDRESS R13
+// vm.stack_top, written back before every helper call and on the way out.
+#define STACK_TOP R14
+#define CLOSURE R15
+
+// The condition codes of jcc and setcc.
+typedef enum {
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_NP = 0xb,
+    CC_ALWAYS = -1,
+} Condition;
+
+typedef struct {
+    // the bytecode offset the jump goes to.
+    int target;
+    // where the rel32 of the jump is.
+    int position;
+} Fixup;
+
+typedef struct {
+    int count;
+    int capacity;
+    Fixup *fixups;
+} Fixups;
+
+// What a trace knows about the frame slots, locals and temporaries, at the instruction it compiles.
+typedef struct {
+    // whether each slot holds a number.
+    bool *numbers;
+    // the slots in use.
+    int top;
+} Types;
+
+typedef struct {
+    Chunk *chunk;
+    // NULL unless compiling a trace.
+    Types *types;
+    int count;
+    int capacity;
+    uint8_t *code;
+    // the position of each instruction's code by bytecode offset, -1 inside an instruction.
+    int *positions;
+    // jumps to the code of an instruction.
+    Fixups jumps;
+    // jumps back to run() at the start of an instruction.
+    Fixups exits;
+    int epilogue;
+    int error;
+} Assembler;
+
+bool jit_enabled = false;
+
+void jit_enable() {
+    jit_enabled = true;
+}
+
+static void emit_byte(Assembler *as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int old_capacity = as->capacity;
+        as->capacity = GROW_CAPACITY(old_capacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, old_capacity, as->capacity);
+    }
+
+    as->code[as->count++] = byte;
+}
+
+static void emit_u32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        emit_byte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void emit_u64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        emit_byte(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void emit_rex(Assembler *as, bool wide, int reg, int index, int base) {
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40) {
+        emit_byte(as, rex);
+    }
+}
+
+/**
+ * Emits opcode with reg and the memory operand [base + disp].
+ */
+static void emit_memory(Assembler *as, bool wide, uint8_t opcode, int reg, Register base, int32_t disp) {
+    emit_rex(as, wide, reg, 0, base);
+    emit_byte(as, opcode);
+    emit_byte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit_byte(as, 0x24);
+    }
+    emit_u32(as, (uint32_t) disp);
+}
+
+/**
+ * Emits opcode with reg and the register operand rm, the destination of the "op r/m, reg" forms.
+ */
+static void emit_registers(Assembler *as, bool wide, uint8_t opcode, int reg, Register rm) {
+    emit_rex(as, wide, reg, 0, rm);
+    emit_byte(as, opcode);
+    emit_byte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_load(Assembler *as, Register dst, Register base, int32_t disp) {
+    emit_memory(as, true, 0x8b, dst, base, disp);
+}
+
+static void emit_store(Assembler *as, Register base, int32_t disp, Register src) {
+    emit_memory(as, true, 0x89, src, base, disp);
+}
+
+/**
+ * Emits mov dst, [base + index * 8], base must not be RBP or R13.
+ */
+static void emit_load_indexed(Assembler *as, Register dst, Register base, Register index) {
+    emit_rex(as, true, dst, index, base);
+    emit_byte(as, 0x8b);
+    emit_byte(as, ((dst & 7) << 3) | RSP);
+    emit_byte(as, 0xc0 | ((index & 7) << 3) | (base & 7));
+}
+
+static void emit_move(Assembler *as, Register dst, Register src) {
+    emit_registers(as, true, 0x89, src, dst);
+}
+
+static void emit_immediate(Assembler *as, Register dst, uint64_t value) {
+    emit_rex(as, true, 0, 0, dst);
+    emit_byte(as, 0xb8 | (dst & 7));
+    emit_u64(as, value);
+}
+
+static void emit_immediate32(Assembler *as, Register dst, uint32_t value) {
+    emit_rex(as, false, 0, 0, dst);
+    emit_byte(as, 0xb8 | (dst & 7));
+    emit_u32(as, value);
+}
+
+static void emit_push(Assembler *as, Register reg) {
+    emit_rex(as, false, 0, 0, reg);
+    emit_byte(as, 0x50 | (reg & 7));
+}
+
+static void emit_pop(Assembler *as, Register reg) {
+    emit_rex(as, false, 0, 0, reg);
+    emit_byte(as, 0x58 | (reg & 7));
+}
+
+/**
+ * Emits a jump, or a conditional one, and returns the position of its rel32 for patch_jump().
+ */
+static int emit_jump(Assembler *as, Condition condition) {
+    if (condition == CC_ALWAYS) {
+        emit_byte(as, 0xe9);
+    } else {
+        emit_byte(as, 0x0f);
+        emit_byte(as, 0x80 | condition);
+    }
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+static void patch_jump(Assembler *as, int position, int target) {
+    uint32_t rel = (uint32_t) (target - (position + 4));
+    for (int i = 0; i < 4; ++i) {
+        as->code[position + i] = (rel >> (i * 8)) & 0xff;
+    }
+}
+
+static void emit_jump_to(Assembler *as, Condition condition, int target) {
+    patch_jump(as, emit_jump(as, condition), target);
+}
+
+static void add_fixup(Fixups *fixups, int target, int position) {
+    if (fixups->capacity < fixups->count + 1) {
+        int old_capacity = fixups->capacity;
+        fixups->capacity = GROW_CAPACITY(old_capacity);
+        fixups->fixups = GROW_ARRAY(Fixup, fixups->fixups, old_capacity, fixups->capacity);
+    }
+
+    fixups->fixups[fixups->count].target = target;
+    fixups->fixups[fixups->count].position = position;
+    fixups->count++;
+}
+
+static void jump_to_instruction(Assembler *as, Condition condition, int target) {
+    add_fixup(&as->jumps, target, emit_jump(as, condition));
+}
+
+/**
+ * Leaves the native code for run(), which carries on at the instruction at offset.
+ */
+static void exit_to(Assembler *as, Condition condition, int offset) {
+    add_fixup(&as->exits, offset, emit_jump(as, condition));
+}
+
+static void load_stack(Assembler *as, Register dst, int distance) {
+    emit_load(as, dst, STACK_TOP, -8 * (distance + 1));
+}
+
+static void store_stack(Assembler *as, int distance, Register src) {
+    emit_store(as, STACK_TOP, -8 * (distance + 1), src);
+}
+
+static void adjust_stack(Assembler *as, int count) {
+    // add or sub r14, imm32
+    emit_registers(as, true, 0x81, count < 0 ? 5 : 0, STACK_TOP);
+    emit_u32(as, (uint32_t) (8 * (count < 0 ? -count : count)));
+}
+
+static void push_value(Assembler *as, Register src) {
+    store_stack(as, -1, src);
+    adjust_stack(as, 1);
+}
+
+/**
+ * Jumps to the exit of the instruction at offset unless reg holds a number, if that isn't known already.
+ * Clobbers r9 and r10.
+ */
+static void guard_number(Assembler *as, Register reg, bool is_number, int offset) {
+    if (is_number) {
+        return;
+    }
+
+    emit_immediate(as, R10, QNAN);
+    emit_move(as, R9, reg);
+    emit_registers(as, true, 0x21, R10, R9);
+    emit_registers(as, true, 0x39, R10, R9);
+    exit_to(as, CC_E, offset);
+}
+
+/**
+ * Makes al the Lox bool in rax.
+ */
+static void bool_value(Assembler *as) {
+    // movzx eax, al
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0xb6);
+    emit_byte(as, 0xc0);
+    emit_immediate(as, RCX, FALSE_VAL);
+    // TRUE_VAL is FALSE_VAL + 1.
+    emit_registers(as, true, 0x01, RCX, RAX);
+}
+
+static void set_condition(Assembler *as, Condition condition, Register reg) {
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x90 | condition);
+    emit_byte(as, 0xc0 | reg);
+}
+
+static void move_to_xmm(Assembler *as, int xmm, Register src) {
+    emit_byte(as, 0x66);
+    emit_rex(as, true, xmm, 0, src);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x6e);
+    emit_byte(as, 0xc0 | (xmm << 3) | (src & 7));
+}
+
+static void move_from_xmm(Assembler *as, Register dst, int xmm) {
+    emit_byte(as, 0x66);
+    emit_rex(as, true, xmm, 0, dst);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x7e);
+    emit_byte(as, 0xc0 | (xmm << 3) | (dst & 7));
+}
+
+/**
+ * Emits the arithmetic op of instruction on the numbers a in rax and b in rcx, leaving the number in rax.
+ */
+static void number_arithmetic(Assembler *as, uint8_t instruction) {
+    uint8_t opcode;
+    switch (instruction) {
+        case OP_ADD:
+            opcode = 0x58;
+            break;
+        case OP_SUBTRACT:
+            opcode = 0x5c;
+            break;
+        case OP_MULTIPLY:
+            opcode = 0x59;
+            break;
+        default:
+            opcode = 0x5e;
+            break;
+    }
+
+    move_to_xmm(as, 0, RAX);
+    move_to_xmm(as, 1, RCX);
+    // addsd, subsd, mulsd or divsd xmm0, xmm1
+    emit_byte(as, 0xf2);
+    emit_byte(as, 0x0f);
+    emit_byte(as, opcode);
+    emit_byte(as, 0xc1);
+    move_from_xmm(as, RAX, 0);
+}
+
+/**
+ * Emits the comparison of instruction on the numbers a in rax and b in rcx, leaving the result in al.
+ */
+static void number_comparison(Assembler *as, uint8_t instruction) {
+    // ucomisd sets CF and ZF, both also set when either is NaN, as for its first operand minus its second.
+    // OP_GREATER_EQUAL and OP_LESS_EQUAL are !(a < b) and !(a > b), so they are true for NaN.
+    bool swap = instruction == OP_LESS || instruction == OP_GREATER_EQUAL;
+    Condition condition = instruction == OP_GREATER || instruction == OP_LESS ? CC_A : CC_BE;
+
+    move_to_xmm(as, 0, RAX);
+    move_to_xmm(as, 1, RCX);
+    // ucomisd
+    emit_byte(as, 0x66);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2e);
+    emit_byte(as, swap ? 0xc8 : 0xc1);
+    set_condition(as, condition, RAX);
+}
+
+/**
+ * Emits values_equal() of a in rax and b in rcx, leaving the result in al.
+ */
+static void values_equal_code(Assembler *as) {
+    emit_immediate(as, R10, QNAN);
+    emit_move(as, R9, RAX);
+    emit_registers(as, true, 0x21, R10, R9);
+    emit_registers(as, true, 0x39, R10, R9);
+    int a_not_number = emit_jump(as, CC_E);
+    emit_move(as, R9, RCX);
+    emit_registers(as, true, 0x21, R10, R9);
+    emit_registers(as, true, 0x39, R10, R9);
+    int b_not_number = emit_jump(as, CC_E);
+
+    // two numbers are equal as doubles, NaN to nothing.
+    move_to_xmm(as, 0, RAX);
+    move_to_xmm(as, 1, RCX);
+    emit_byte(as, 0x66);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2e);
+    emit_byte(as, 0xc1);
+    set_condition(as, CC_E, RAX);
+    set_condition(as, CC_NP, RDX);
+    // and al, dl
+    emit_byte(as, 0x20);
+    emit_byte(as, 0xd0);
+    int done = emit_jump(as, CC_ALWAYS);
+
+    // anything else equals itself, and two different objects can still be strings with the same characters.
+    patch_jump(as, a_not_number, as->count);
+    patch_jump(as, b_not_number, as->count);
+    emit_registers(as, true, 0x39, RCX, RAX);
+    set_condition(as, CC_E, RDX);
+    int same = emit_jump(as, CC_E);
+    emit_immediate(as, R10, SIGN_BIT | QNAN);
+    emit_move(as, R9, RAX);
+    emit_registers(as, true, 0x21, RCX, R9);
+    emit_registers(as, true, 0x21, R10, R9);
+    emit_registers(as, true, 0x39, R10, R9);
+    int not_objects = emit_jump(as, CC_NE);
+    // values_equal() may flatten a rope, which allocates, so the GC has to see the stack as it is.
+    emit_move(as, RDI, RAX);
+    emit_move(as, RSI, RCX);
+    emit_store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+    emit_immediate(as, RAX, (uint64_t) (uintptr_t) values_equal);
+    // call rax
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xd0);
+    emit_move(as, RDX, RAX);
+    patch_jump(as, same, as->count);
+    patch_jump(as, not_objects, as->count);
+    emit_move(as, RAX, RDX);
+    patch_jump(as, done, as->count);
+}
+
+/**
+ * Emits is_falsey() of rax, leaving the result in al. Clobbers rcx and rdx.
+ */
+static void falsey_code(Assembler *as) {
+    emit_immediate(as, RCX, NIL_VAL);
+    emit_registers(as, true, 0x39, RCX, RAX);
+    set_condition(as, CC_E, RDX);
+    emit_immediate(as, RCX, FALSE_VAL);
+    emit_registers(as, true, 0x39, RCX, RAX);
+    set_condition(as, CC_E, RAX);
+    // or al, dl
+    emit_byte(as, 0x08);
+    emit_byte(as, 0xd0);
+}
+
+static void test_al(Assembler *as) {
+    emit_byte(as, 0x84);
+    emit_byte(as, 0xc0);
+}
+
+/**
+ * Calls helper the way run() would run the instruction ending at next: with frame->ip at next and vm.stack_top
+ * written back, reloading the stack top afterwards. The arguments are expected in rdi, rsi, rdx and ecx already.
+ */
+static void emit_helper_call(Assembler *as, void *helper, int next) {
+    emit_immediate(as, RAX, (uint64_t) (uintptr_t) (as->chunk->code + next));
+    emit_store(as, FRAME, offsetof(CallFrame, ip), RAX);
+    emit_store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+    emit_immediate(as, RAX, (uint64_t) (uintptr_t) helper);
+    // call rax
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xd0);
+    emit_load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+}
+
+/**
+ * Calls a helper that may push, and so move the stack under the slots. The frame itself only moves when a call
+ * pushes another one, which call_status() leaves the native code for.
+ */
+static void call_helper(Assembler *as, void *helper, int next) {
+    emit_helper_call(as, helper, next);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+/**
+ * Calls a helper returning false on a runtime error.
+ */
+static void call_checked(Assembler *as, void *helper, int next) {
+    call_helper(as, helper, next);
+    test_al(as);
+    emit_jump_to(as, CC_E, as->error);
+}
+
+/**
+ * Calls a helper returning a JitStatus, leaving the native code for anything but JIT_CONTINUE.
+ */
+static void call_status(Assembler *as, void *helper, int next) {
+    emit_helper_call(as, helper, next);
+    // test eax, eax
+    emit_byte(as, 0x85);
+    emit_byte(as, 0xc0);
+    emit_jump_to(as, CC_NE, as->epilogue);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+}
+
+static Value constant(Assembler *as, int index) {
+    return as->chunk->constants.values[index];
+}
+
+/**
+ * Returns whether the value at distance from the top of the stack is known to be a number.
+ */
+static bool stack_number(Assembler *as, int distance) {
+    return as->types != NULL && as->types->numbers[as->types->top - 1 - distance];
+}
+
+/**
+ * Returns whether a register op source operand is known to be a number.
+ */
+static bool register_number(Assembler *as, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        return IS_NUMBER(constant(as, operand & ~RK_CONSTANT));
+    }
+
+    return as->types != NULL && as->types->numbers[operand];
+}
+
+/**
+ * Loads a register op source operand, a frame slot or a constant, see RK_CONSTANT.
+ */
+static void load_register(Assembler *as, Register dst, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        emit_immediate(as, dst, constant(as, operand & ~RK_CONSTANT));
+    } else {
+        emit_load(as, dst, SLOTS, 8 * operand);
+    }
+}
+
+/**
+ * Leaves the comparison instruction of a register compare-and-branch, of the two values in rax and rcx, in al.
+ * a_number and b_number tell whether they are known to be numbers.
+ */
+static void register_comparison(Assembler *as, uint8_t instruction, int offset, bool a_number, bool b_number) {
+    switch (instruction) {
+        case OP_REG_JUMP_UNLESS_EQUAL:
+            values_equal_code(as);
+            return;
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+            values_equal_code(as);
+            // xor al, 1
+            emit_byte(as, 0x34);
+            emit_byte(as, 0x01);
+            return;
+        default:
+            break;
+    }
+
+    guard_number(as, RAX, a_number, offset);
+    guard_number(as, RCX, b_number, offset);
+    switch (instruction) {
+        case OP_REG_JUMP_UNLESS_GREATER:
+            number_comparison(as, OP_GREATER);
+            break;
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+            number_comparison(as, OP_GREATER_EQUAL);
+            break;
+        case OP_REG_JUMP_UNLESS_LESS:
+            number_comparison(as, OP_LESS);
+            break;
+        default:
+            number_comparison(as, OP_LESS_EQUAL);
+            break;
+    }
+}
+
+static void global_values(Assembler *as, Register dst) {
+    // the array moves as globals get added, so it is read each time.
+    emit_immediate(as, dst, (uint64_t) (uintptr_t) &vm.global_values.values);
+    emit_load(as, dst, dst, 0);
+}
+
+static void load_upvalue_location(Assembler *as, Register dst, int index) {
+    emit_load(as, dst, CLOSURE, (int32_t) (offsetof(ObjClosure, upvalues) + 8 * index));
+    emit_load(as, dst, dst, offsetof(ObjUpvalue, location));
+}
+
+/**
+ * Loads the address of slot of the frame the running closure was created in, see OP_GET_ENCLOSING. Clobbers rdx.
+ */
+static void load_enclosing_location(Assembler *as, Register dst, int slot) {
+    // the stack moves as it grows, so it is read each time.
+    emit_immediate(as, dst, (uint64_t) (uintptr_t) &vm.stack);
+    emit_load(as, dst, dst, 0);
+    emit_memory(as, false, 0x8b, RDX, CLOSURE, offsetof(ObjClosure, frame_base));
+    // lea dst, [dst + rdx * 8 + 8 * slot]
+    emit_rex(as, true, dst, RDX, dst);
+    emit_byte(as, 0x8d);
+    emit_byte(as, 0x80 | ((dst & 7) << 3) | RSP);
+    emit_byte(as, 0xc0 | ((RDX & 7) << 3) | (dst & 7));
+    emit_u32(as, (uint32_t) (8 * slot));
+}
+
+/**
+ * Emits the inline shape check of OP_GET_PROPERTY, falling back to jit_get_property() when it misses.
+ */
+static void get_property(Assembler *as, ObjString *name, PropertyCache *cache, int next) {
+    load_stack(as, RAX, 0);
+    emit_immediate(as, R10, SIGN_BIT | QNAN);
+    emit_move(as, R9, RAX);
+    emit_registers(as, true, 0x21, R10, R9);
+    emit_registers(as, true, 0x39, R10, R9);
+    int not_object = emit_jump(as, CC_NE);
+    // the tag bits are all set, so clearing them leaves the pointer.
+    emit_move(as, R9, RAX);
+    emit_registers(as, true, 0x31, R10, R9);
+    // cmp dword [r9 + type], OBJ_INSTANCE
+    emit_memory(as, false, 0x81, 7, R9, offsetof(Obj, type));
+    emit_u32(as, OBJ_INSTANCE);
+    int not_instance = emit_jump(as, CC_NE);
+    emit_load(as, R10, R9, offsetof(ObjInstance, shape));
+    // test r10, r10
+    emit_registers(as, true, 0x85, R10, R10);
+    int dictionary = emit_jump(as, CC_E);
+    emit_immediate(as, R11, (uint64_t) (uintptr_t) cache);
+    emit_load(as, RCX, R11, offsetof(PropertyCache, shape));
+    emit_registers(as, true, 0x39, RCX, R10);
+    int other_shape = emit_jump(as, CC_NE);
+    emit_memory(as, false, 0x8b, R11, R11, offsetof(PropertyCache, slot));
+    emit_load(as, R10, R9, offsetof(ObjInstance, fields));
+    emit_load_indexed(as, RAX, R10, R11);
+    store_stack(as, 0, RAX);
+    int done = emit_jump(as, CC_ALWAYS);
+
+    patch_jump(as, not_object, as->count);
+    patch_jump(as, not_instance, as->count);
+    patch_jump(as, dictionary, as->count);
+    patch_jump(as, other_shape, as->count);
+    emit_immediate(as, RDI, (uint64_t) (uintptr_t) name);
+    emit_immediate(as, RSI, (uint64_t) (uintptr_t) cache);
+    call_checked(as, jit_get_property, next);
+    patch_jump(as, done, as->count);
+}
+
+static void invoke(Assembler *as, void *helper, ObjString *name, int arg_count, InlineCache *cache, int next) {
+    emit_immediate(as, RDI, (uint64_t) (uintptr_t) name);
+    emit_immediate32(as, RSI, arg_count);
+    emit_immediate(as, RDX, (uint64_t) (uintptr_t) cache);
+    call_status(as, helper, next);
+}
+
+static int far_jump_offset(Chunk *chunk, uint8_t *operand) {
+    return chunk->far_jumps[(operand[0] << 8) | operand[1]].offset;
+}
+
+static void compile_instruction(Assembler *as, int offset, uint8_t instruction, int length) {
+    Chunk *chunk = as->chunk;
+    uint8_t *code = chunk->code + offset;
+    int next = offset + length;
+
+    switch (instruction) {
+        case OP_CONSTANT:
+            emit_immediate(as, RAX, constant(as, code[1]));
+            push_value(as, RAX);
+            break;
+        case OP_NIL:
+            emit_immediate(as, RAX, NIL_VAL);
+            push_value(as, RAX);
+            break;
+        case OP_TRUE:
+            emit_immediate(as, RAX, TRUE_VAL);
+            push_value(as, RAX);
+            break;
+        case OP_FALSE:
+            emit_immediate(as, RAX, FALSE_VAL);
+            push_value(as, RAX);
+            break;
+        case OP_POP:
+            adjust_stack(as, -1);
+            break;
+        case OP_GET_LOCAL:
+            emit_load(as, RAX, SLOTS, 8 * code[1]);
+            push_value(as, RAX);
+            break;
+        case OP_SET_LOCAL:
+            load_stack(as, RAX, 0);
+            emit_store(as, SLOTS, 8 * code[1], RAX);
+            break;
+        case OP_GET_GLOBAL:
+            global_values(as, RCX);
+            emit_load(as, RAX, RCX, 8 * code[1]);
+            emit_immediate(as, R10, UNDEFINED_VAL);
+            emit_registers(as, true, 0x39, R10, RAX);
+            exit_to(as, CC_E, offset);
+            push_value(as, RAX);
+            break;
+        case OP_DEFINE_GLOBAL:
+            global_values(as, RCX);
+            load_stack(as, RAX, 0);
+            emit_store(as, RCX, 8 * code[1], RAX);
+            adjust_stack(as, -1);
+            break;
+        case OP_SET_GLOBAL:
+            global_values(as, RCX);
+            emit_load(as, RAX, RCX, 8 * code[1]);
+            emit_immediate(as, R10, UNDEFINED_VAL);
+            emit_registers(as, true, 0x39, R10, RAX);
+            exit_to(as, CC_E, offset);
+            load_stack(as, RAX, 0);
+            emit_store(as, RCX, 8 * code[1], RAX);
+            break;
+        case OP_GET_UPVALUE:
+            load_upvalue_location(as, RCX, code[1]);
+            emit_load(as, RAX, RCX, 0);
+            push_value(as, RAX);
+            break;
+        case OP_SET_UPVALUE:
+            load_upvalue_location(as, RCX, code[1]);
+            load_stack(as, RAX, 0);
+            emit_store(as, RCX, 0, RAX);
+            break;
+        case OP_GET_ENCLOSING:
+            load_enclosing_location(as, RCX, code[1]);
+            emit_load(as, RAX, RCX, 0);
+            push_value(as, RAX);
+            break;
+        case OP_SET_ENCLOSING:
+            load_enclosing_location(as, RCX, code[1]);
+            load_stack(as, RAX, 0);
+            emit_store(as, RCX, 0, RAX);
+            break;
+        case OP_GET_PROPERTY:
+            get_property(as, AS_STRING(constant(as, code[1])),
+                         &chunk->property_caches[(code[2] << 8) | code[3]], next);
+            break;
+        case OP_SET_PROPERTY:
+            emit_immediate(as, RDI, (uint64_t) (uintptr_t) AS_STRING(constant(as, code[1])));
+            call_checked(as, jit_set_property, next);
+            break;
+        case OP_GET_SUPER:
+            emit_immediate(as, RDI, (uint64_t) (uintptr_t) AS_STRING(constant(as, code[1])));
+            emit_immediate(as, RSI, (uint64_t) (uintptr_t) &chunk->inline_caches[(code[2] << 8) | code[3]]);
+            call_checked(as, jit_get_super, next);
+            break;
+        case OP_SUPER_INVOKE:
+            invoke(as, jit_super_invoke, AS_STRING(constant(as, code[1])), code[2],
+                   &chunk->inline_caches[(code[3] << 8) | code[4]], next);
+            break;
+        case OP_INVOKE:
+            invoke(as, jit_invoke, AS_STRING(constant(as, code[1])), code[2],
+                   &chunk->inline_caches[(code[3] << 8) | code[4]], next);
+            break;
+        case OP_TAIL_INVOKE:
+            invoke(as, jit_tail_invoke, AS_STRING(constant(as, code[1])), code[2],
+                   &chunk->inline_caches[(code[3] << 8) | code[4]], next);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            load_stack(as, RAX, 1);
+            load_stack(as, RCX, 0);
+            values_equal_code(as);
+            if (instruction == OP_NOT_EQUAL) {
+                // xor al, 1
+                emit_byte(as, 0x34);
+                emit_byte(as, 0x01);
+            }
+            bool_value(as);
+            store_stack(as, 1, RAX);
+            adjust_stack(as, -1);
+            break;
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            load_stack(as, RAX, 1);
+            load_stack(as, RCX, 0);
+            guard_number(as, RAX, stack_number(as, 1), offset);
+            guard_number(as, RCX, stack_number(as, 0), offset);
+            number_comparison(as, instruction);
+            bool_value(as);
+            store_stack(as, 1, RAX);
+            adjust_stack(as, -1);
+            break;
+        case OP_ADD: {
+            load_stack(as, RAX, 1);
+            load_stack(as, RCX, 0);
+            emit_immediate(as, R10, QNAN);
+            emit_move(as, R9, RAX);
+            emit_registers(as, true, 0x21, R10, R9);
+            emit_registers(as, true, 0x39, R10, R9);
+            int a_not_number = emit_jump(as, CC_E);
+            emit_move(as, R9, RCX);
+            emit_registers(as, true, 0x21, R10, R9);
+            emit_registers(as, true, 0x39, R10, R9);
+            int b_not_number = emit_jump(as, CC_E);
+            number_arithmetic(as, OP_ADD);
+            store_stack(as, 1, RAX);
+            adjust_stack(as, -1);
+            int done = emit_jump(as, CC_ALWAYS);
+
+            patch_jump(as, a_not_number, as->count);
+            patch_jump(as, b_not_number, as->count);
+            call_checked(as, jit_add, next);
+            patch_jump(as, done, as->count);
+            break;
+        }
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            load_stack(as, RAX, 1);
+            load_stack(as, RCX, 0);
+            guard_number(as, RAX, stack_number(as, 1), offset);
+            guard_number(as, RCX, stack_number(as, 0), offset);
+            number_arithmetic(as, instruction);
+            store_stack(as, 1, RAX);
+            adjust_stack(as, -1);
+            break;
+        case OP_NOT:
+            load_stack(as, RAX, 0);
+            falsey_code(as);
+            bool_value(as);
+            store_stack(as, 0, RAX);
+            break;
+        case OP_NEGATE:
+            load_stack(as, RAX, 0);
+            guard_number(as, RAX, stack_number(as, 0), offset);
+            emit_immediate(as, R10, SIGN_BIT);
+            emit_registers(as, true, 0x31, R10, RAX);
+            store_stack(as, 0, RAX);
+            break;
+        case OP_PRINT:
+            call_helper(as, jit_print, next);
+            break;
+        case OP_JUMP:
+            jump_to_instruction(as, CC_ALWAYS, next + ((code[1] << 8) | code[2]));
+            break;
+        case OP_JUMP_FAR:
+            jump_to_instruction(as, CC_ALWAYS, next + far_jump_offset(chunk, code + 1));
+            break;
+        case OP_LOOP:
+            jump_to_instruction(as, CC_ALWAYS, next - ((code[1] << 8) | code[2]));
+            break;
+        case OP_LOOP_FAR:
+            jump_to_instruction(as, CC_ALWAYS, next - far_jump_offset(chunk, code + 1));
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_FAR: {
+            int target = next + (instruction == OP_JUMP_IF_FALSE
+                                     ? (code[1] << 8) | code[2]
+                                     : far_jump_offset(chunk, code + 1));
+            load_stack(as, RAX, 0);
+            falsey_code(as);
+            test_al(as);
+            jump_to_instruction(as, CC_NE, target);
+            break;
+        }
+        case OP_CALL:
+            emit_immediate32(as, RDI, code[1]);
+            call_status(as, jit_call, next);
+            break;
+        case OP_TAIL_CALL:
+            emit_immediate32(as, RDI, code[1]);
+            call_status(as, jit_tail_call, next);
+            break;
+        case OP_CLOSE_UPVALUE:
+            call_helper(as, jit_close_upvalue, next);
+            break;
+        case OP_RETURN:
+            call_helper(as, jit_return, next);
+            emit_jump_to(as, CC_ALWAYS, as->epilogue);
+            break;
+        case OP_ADD_SMALL:
+        case OP_SUBTRACT_SMALL:
+        case OP_LESS_SMALL:
+        case OP_LESS_EQUAL_SMALL:
+        case OP_GREATER_SMALL:
+        case OP_GREATER_EQUAL_SMALL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_CONSTANT:
+        case OP_LESS_EQUAL_CONSTANT:
+        case OP_GREATER_CONSTANT:
+        case OP_GREATER_EQUAL_CONSTANT: {
+            // the _SMALL and _CONSTANT forms alternate.
+            bool small = (instruction - OP_ADD_SMALL) % 2 == 0;
+            Value b = small ? NUMBER_VAL((double) code[1]) : constant(as, code[1]);
+            load_stack(as, RAX, 0);
+            guard_number(as, RAX, stack_number(as, 0), offset);
+            emit_immediate(as, RCX, b);
+            switch (instruction) {
+                case OP_ADD_SMALL:
+                case OP_ADD_CONSTANT:
+                    number_arithmetic(as, OP_ADD);
+                    break;
+                case OP_SUBTRACT_SMALL:
+                case OP_SUBTRACT_CONSTANT:
+                    number_arithmetic(as, OP_SUBTRACT);
+                    break;
+                case OP_LESS_SMALL:
+                case OP_LESS_CONSTANT:
+                    number_comparison(as, OP_LESS);
+                    bool_value(as);
+                    break;
+                case OP_LESS_EQUAL_SMALL:
+                case OP_LESS_EQUAL_CONSTANT:
+                    number_comparison(as, OP_LESS_EQUAL);
+                    bool_value(as);
+                    break;
+                case OP_GREATER_SMALL:
+                case OP_GREATER_CONSTANT:
+                    number_comparison(as, OP_GREATER);
+                    bool_value(as);
+                    break;
+                default:
+                    number_comparison(as, OP_GREATER_EQUAL);
+                    bool_value(as);
+                    break;
+            }
+            store_stack(as, 0, RAX);
+            break;
+        }
+        case OP_REG_MOVE:
+            load_register(as, RAX, code[2]);
+            emit_store(as, SLOTS, 8 * code[1], RAX);
+            break;
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+            // OP_REG_ADD of two strings goes back to run().
+            load_register(as, RAX, code[2]);
+            load_register(as, RCX, code[3]);
+            guard_number(as, RAX, register_number(as, code[2]), offset);
+            guard_number(as, RCX, register_number(as, code[3]), offset);
+            number_arithmetic(as, OP_ADD + (instruction - OP_REG_ADD));
+            emit_store(as, SLOTS, 8 * code[1], RAX);
+            break;
+        case OP_REG_JUMP_UNLESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+        case OP_REG_JUMP_UNLESS_GREATER:
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_REG_JUMP_UNLESS_LESS:
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_FAR: {
+            int target = next + ((code[3] << 8) | code[4]);
+            if (instruction == OP_REG_JUMP_UNLESS_FAR) {
+                FarJump *jump = &chunk->far_jumps[(code[3] << 8) | code[4]];
+                instruction = jump->instruction;
+                target = next + jump->offset;
+            }
+            load_register(as, RAX, code[1]);
+            load_register(as, RCX, code[2]);
+            register_comparison(as, instruction, offset, register_number(as, code[1]),
+                                register_number(as, code[2]));
+            test_al(as);
+            jump_to_instruction(as, CC_E, target);
+            break;
+        }
+        default:
+            // declarations, closures and wide operands are left to run().
+            exit_to(as, CC_ALWAYS, offset);
+            break;
+    }
+}
+
+static void emit_prologue(Assembler *as) {
+    emit_push(as, RBX);
+    emit_push(as, R12);
+    emit_push(as, R13);
+    emit_push(as, R14);
+    emit_push(as, R15);
+    emit_move(as, FRAME, RDI);
+    emit_load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emit_load(as, CLOSURE, FRAME, offsetof(CallFrame, closure));
+    emit_immediate(as, STACK_TOP_ADDRESS, (uint64_t) (uintptr_t) &vm.stack_top);
+    emit_load(as, STACK_TOP, STACK_TOP_ADDRESS, 0);
+    // jmp rsi
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xe6);
+
+    as->epilogue = as->count;
+    emit_store(as, STACK_TOP_ADDRESS, 0, STACK_TOP);
+    emit_pop(as, R15);
+    emit_pop(as, R14);
+    emit_pop(as, R13);
+    emit_pop(as, R12);
+    emit_pop(as, RBX);
+    emit_byte(as, 0xc3);
+
+    as->error = as->count;
+    emit_immediate32(as, RAX, JIT_ERROR);
+    emit_jump_to(as, CC_ALWAYS, as->epilogue);
+}
+
+/**
+ * Emits the code of every exit, which stores the ip run() resumes at, and patches the jumps to it.
+ */
+static void emit_exits(Assembler *as) {
+    int *stubs = ALLOCATE(int, as->chunk->count);
+    for (int i = 0; i < as->chunk->count; ++i) {
+        stubs[i] = -1;
+    }
+
+    for (int i = 0; i < as->exits.count; ++i) {
+        Fixup *exit = &as->exits.fixups[i];
+        if (stubs[exit->target] == -1) {
+            stubs[exit->target] = as->count;
+            emit_immediate(as, RAX, (uint64_t) (uintptr_t) (as->chunk->code + exit->target));
+            emit_store(as, FRAME, offsetof(CallFrame, ip), RAX);
+            emit_immediate32(as, RAX, JIT_EXIT);
+            emit_jump_to(as, CC_ALWAYS, as->epilogue);
+        }
+        patch_jump(as, exit->position, stubs[exit->target]);
+    }
+
+    FREE_ARRAY(int, stubs, as->chunk->count);
+}
+
+static bool assemble(Assembler *as) {
+    Chunk *chunk = as->chunk;
+    emit_prologue(as);
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length;
+        uint8_t instruction = decode_instruction(chunk, offset, &length);
+        as->positions[offset] = as->count;
+        compile_instruction(as, offset, instruction, length);
+        offset += length;
+    }
+
+    for (int i = 0; i < as->jumps.count; ++i) {
+        Fixup *jump = &as->jumps.fixups[i];
+        if (jump->target < 0 || jump->target >= chunk->count || as->positions[jump->target] == -1) {
+            return false;
+        }
+        patch_jump(as, jump->position, as->positions[jump->target]);
+    }
+
+    emit_exits(as);
+    return true;
+}
+
+/**
+ * Copies the assembled code into executable memory, returning NULL if it can't be mapped.
+ */
+static void *map_code(Assembler *as) {
+    void *memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, as->count);
+        return NULL;
+    }
+
+    return memory;
+}
+
+static JitCode *install(Assembler *as) {
+    void *memory = map_code(as);
+    if (memory == NULL) {
+        return NULL;
+    }
+
+    int entry_count = as->chunk->count;
+    void **entries = ALLOCATE(void*, entry_count);
+    for (int offset = 0; offset < entry_count; ++offset) {
+        entries[offset] = as->positions[offset] == -1 ? NULL : (uint8_t *) memory + as->positions[offset];
+    }
+
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->code = (NativeCode) memory;
+    jit->entries = entries;
+    jit->entry_count = entry_count;
+    jit->memory = memory;
+    jit->size = as->count;
+    return jit;
+}
+
+static void init_assembler(Assembler *as, Chunk *chunk) {
+    as->chunk = chunk;
+    as->types = NULL;
+    as->count = 0;
+    as->capacity = 0;
+    as->code = NULL;
+    as->jumps = (Fixups){0, 0, NULL};
+    as->exits = (Fixups){0, 0, NULL};
+    as->positions = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; ++i) {
+        as->positions[i] = -1;
+    }
+}
+
+static void free_assembler(Assembler *as) {
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(int, as->positions, as->chunk->count);
+    FREE_ARRAY(Fixup, as->jumps.fixups, as->jumps.capacity);
+    FREE_ARRAY(Fixup, as->exits.fixups, as->exits.capacity);
+}
+
+void jit_compile(ObjFunction *function) {
+    if (!jit_enabled) {
+        return;
+    }
+
+    Assembler as;
+    init_assembler(&as, &function->chunk);
+    if (assemble(&as)) {
+        // stays interpreted if the code can't be mapped.
+        function->jit = install(&as);
+    }
+    free_assembler(&as);
+}
+
+// An instruction of a trace: one of the recorded steps, or a part of a superinstruction one of them ran.
+typedef struct {
+    int offset;
+    uint8_t instruction;
+    int length;
+    // the offset of the instruction the recorded iteration ran next.
+    int next;
+    bool numbers;
+} TraceInstruction;
+
+static bool register_operand_number(Chunk *chunk, Types *types, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        return IS_NUMBER(chunk->constants.values[operand & ~RK_CONSTANT]);
+    }
+
+    return types->numbers[operand];
+}
+
+/**
+ * Updates types to what they are after instruction.
+ */
+static void apply_types(Chunk *chunk, Types *types, TraceInstruction *instruction) {
+    uint8_t *code = chunk->code + instruction->offset;
+    bool *numbers = types->numbers;
+    switch (instruction->instruction) {
+        case OP_CONSTANT:
+            numbers[types->top++] = IS_NUMBER(chunk->constants.values[code[1]]);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_ENCLOSING:
+            numbers[types->top++] = false;
+            break;
+        case OP_GET_LOCAL:
+            numbers[types->top] = numbers[code[1]];
+            types->top++;
+            break;
+        case OP_SET_LOCAL:
+            numbers[code[1]] = numbers[types->top - 1];
+            break;
+        case OP_POP:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            types->top--;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_LESS_SMALL:
+        case OP_LESS_CONSTANT:
+        case OP_LESS_EQUAL_SMALL:
+        case OP_LESS_EQUAL_CONSTANT:
+        case OP_GREATER_SMALL:
+        case OP_GREATER_CONSTANT:
+        case OP_GREATER_EQUAL_SMALL:
+        case OP_GREATER_EQUAL_CONSTANT:
+            numbers[types->top - 1] = false;
+            break;
+        case OP_NEGATE:
+        case OP_ADD_SMALL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_SMALL:
+        case OP_SUBTRACT_CONSTANT:
+            numbers[types->top - 1] = true;
+            break;
+        case OP_SET_PROPERTY:
+            // the value replaces the instance.
+            types->top--;
+            numbers[types->top - 1] = numbers[types->top];
+            break;
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            types->top--;
+            numbers[types->top - 1] = false;
+            break;
+        case OP_ADD:
+            types->top--;
+            numbers[types->top - 1] = instruction->numbers;
+            break;
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            types->top--;
+            numbers[types->top - 1] = true;
+            break;
+        case OP_CALL:
+            types->top -= code[1];
+            numbers[types->top - 1] = false;
+            break;
+        case OP_REG_MOVE:
+            numbers[code[1]] = register_operand_number(chunk, types, code[2]);
+            break;
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+            numbers[code[1]] = true;
+            break;
+        default:
+            // jumps and stores to globals, upvalues or enclosing frames.
+            break;
+    }
+}
+
+/**
+ * Emits an instruction of the trace. Branches become guards leaving the trace for the way the recording didn't take.
+ */
+static void compile_trace_instruction(Assembler *as, TraceInstruction *instruction) {
+    Chunk *chunk = as->chunk;
+    uint8_t *code = chunk->code + instruction->offset;
+    int offset = instruction->offset;
+    int fallthrough = offset + instruction->length;
+
+    switch (instruction->instruction) {
+        case OP_JUMP:
+        case OP_JUMP_FAR:
+        case OP_LOOP:
+        case OP_LOOP_FAR:
+            // the trace goes on with whatever the iteration ran next.
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_FAR: {
+            int target = jump_target(chunk, offset);
+            if (target == fallthrough) {
+                break;
+            }
+            load_stack(as, RAX, 0);
+            falsey_code(as);
+            test_al(as);
+            if (instruction->next == target) {
+                exit_to(as, CC_E, fallthrough);
+            } else {
+                exit_to(as, CC_NE, target);
+            }
+            break;
+        }
+        case OP_REG_JUMP_UNLESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_NOT_EQUAL:
+        case OP_REG_JUMP_UNLESS_GREATER:
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+        case OP_REG_JUMP_UNLESS_LESS:
+        case OP_REG_JUMP_UNLESS_LESS_EQUAL:
+        case OP_REG_JUMP_UNLESS_FAR: {
+            int target = jump_target(chunk, offset);
+            uint8_t comparison = instruction->instruction;
+            if (comparison == OP_REG_JUMP_UNLESS_FAR) {
+                comparison = chunk->far_jumps[(code[3] << 8) | code[4]].instruction;
+            }
+            load_register(as, RAX, code[1]);
+            load_register(as, RCX, code[2]);
+            register_comparison(as, comparison, offset, register_number(as, code[1]), register_number(as, code[2]));
+            test_al(as);
+            // jumps unless the comparison holds.
+            if (instruction->next == target) {
+                exit_to(as, CC_NE, fallthrough);
+            } else {
+                exit_to(as, CC_E, target);
+            }
+            break;
+        }
+        case OP_ADD:
+            if (!instruction->numbers) {
+                // strings in the recorded iteration don't make them strings in the next one, jit_add() only
+                // takes strings, so keep the number path of the baseline code in front of it.
+                compile_instruction(as, offset, OP_ADD, instruction->length);
+                break;
+            }
+            load_stack(as, RAX, 1);
+            load_stack(as, RCX, 0);
+            guard_number(as, RAX, stack_number(as, 1), offset);
+            guard_number(as, RCX, stack_number(as, 0), offset);
+            number_arithmetic(as, OP_ADD);
+            store_stack(as, 1, RAX);
+            adjust_stack(as, -1);
+            break;
+        default:
+            compile_instruction(as, offset, instruction->instruction, instruction->length);
+            break;
+    }
+
+    apply_types(chunk, as->types, instruction);
+}
+
+/**
+ * Compiles the recorded iteration of the loop trace is for, whose header has depth frame slots in use.
+ * The locals the iteration always leaves as numbers are checked once on entry and then taken for numbers.
+ */
+bool jit_compile_trace(ObjFunction *function, Trace *trace, TraceStep *steps, int step_count, int depth) {
+    Chunk *chunk = &function->chunk;
+    // a superinstruction compiles as up to 4 instructions.
+    int capacity = step_count * 4;
+    TraceInstruction *instructions = ALLOCATE(TraceInstruction, capacity);
+    int count = 0;
+    for (int i = 0; i < step_count; ++i) {
+        int end = steps[i].offset + instruction_length(chunk, steps[i].offset);
+        int following = i + 1 < step_count ? steps[i + 1].offset : trace->header;
+        for (int offset = steps[i].offset; offset < end;) {
+            TraceInstruction *instruction = &instructions[count++];
+            instruction->offset = offset;
+            instruction->instruction = decode_instruction(chunk, offset, &instruction->length);
+            instruction->numbers = steps[i].numbers;
+            offset += instruction->length;
+            instruction->next = offset < end ? offset : following;
+        }
+    }
+
+    int slot_count = function->slot_count + depth + count + 1;
+    bool *numbers = ALLOCATE(bool, slot_count);
+    memset(numbers, 0, sizeof(bool) * slot_count);
+    Types types = {numbers, depth};
+    for (int i = 0; i < count; ++i) {
+        apply_types(chunk, &types, &instructions[i]);
+    }
+
+    bool compiled = false;
+    if (types.top == depth) {
+        // what the iteration leaves is what the next one starts with.
+        memset(numbers + depth, 0, sizeof(bool) * (slot_count - depth));
+
+        Assembler as;
+        init_assembler(&as, chunk);
+        as.types = &types;
+        emit_prologue(&as);
+
+        int entry = as.count;
+        for (int slot = 0; slot < depth; ++slot) {
+            if (numbers[slot]) {
+                emit_load(&as, RAX, SLOTS, 8 * slot);
+                guard_number(&as, RAX, false, trace->header);
+            }
+        }
+
+        int loop = as.count;
+        for (int i = 0; i < count; ++i) {
+            compile_trace_instruction(&as, &instructions[i]);
+        }
+        emit_jump_to(&as, CC_ALWAYS, loop);
+        emit_exits(&as);
+
+        // every jump of the trace is an exit, so there are none within it to patch.
+        void *memory = as.jumps.count == 0 ? map_code(&as) : NULL;
+        if (memory != NULL) {
+            trace->code = (NativeCode) memory;
+            trace->entry = (uint8_t *) memory + entry;
+            trace->memory = memory;
+            trace->size = as.count;
+            compiled = true;
+        }
+        free_assembler(&as);
+    }
+
+    FREE_ARRAY(bool, numbers, slot_count);
+    FREE_ARRAY(TraceInstruction, instructions, capacity);
+    return compiled;
+}
+
+void jit_free(ObjFunction *function) {
+    free_traces(function);
+
+    JitCode *jit = function->jit;
+    if (jit == NULL) {
+        return;
+    }
+
+    munmap(jit->memory, jit->size);
+    FREE_ARRAY(void*, jit->entries, jit->entry_count);
+    FREE(JitCode, jit);
+    function->jit = NULL;
+}
+
+/**
+ * Runs the frame on top, and the frames it calls or returns to, in native code as long as they have some.
+ */
+JitStatus jit_run() {
+    for (;;) {
+        CallFrame *frame = &vm.frames[vm.frame_count - 1];
+        Chunk *chunk = &frame->closure->function->chunk;
+        JitCode *jit = frame->closure->function->jit;
+        if (jit == NULL) {
+            return JIT_EXIT;
+        }
+
+        void *entry = jit->entries[frame->ip - chunk->code];
+        if (entry == NULL) {
+            return JIT_EXIT;
+        }
+
+        JitStatus status = jit->code(frame, entry);
+        if (status != JIT_FRAME) {
+            return status;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,98 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "common.h"
+#include "vm.h"
+
+typedef enum {
+    // the native code carries on with the current frame, only returned by the helpers.
+    JIT_CONTINUE,
+    // run() takes over the current frame at its ip.
+    JIT_EXIT,
+    // a call pushed a frame, a tail call replaced one or a return popped one, and jit_run() picks up whichever is on
+    // top now.
+    JIT_FRAME,
+    JIT_ERROR,
+    // the script returned.
+    JIT_DONE,
+    // run() records the loop iteration it starts on, see trace_record().
+    JIT_RECORD,
+} JitStatus;
+
+// The helpers native code calls for what it doesn't do inline, the JIT's and the C emitted by aot.c alike, defined in
+// vm.c. Each expects frame->ip past the instruction and vm.stack_top up to date, like the op in run() does.
+bool jit_add();
+
+JitStatus jit_call(int arg_count);
+
+JitStatus jit_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+JitStatus jit_super_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+JitStatus jit_tail_call(int arg_count);
+
+JitStatus jit_tail_invoke(ObjString *name, int arg_count, InlineCache *cache);
+
+JitStatus jit_return();
+
+bool jit_get_property(ObjString *name, PropertyCache *cache);
+
+bool jit_set_property(ObjString *name);
+
+bool jit_get_super(ObjString *name, InlineCache *cache);
+
+void jit_close_upvalue();
+
+void jit_print();
+
+bool jit_get_global(int slot);
+
+bool jit_set_global(int slot);
+
+void jit_define_global(int slot);
+
+void jit_closure(ObjFunction *function, bool wide);
+
+void jit_class(ObjString *name);
+
+void jit_method(ObjString *name);
+
+bool jit_inherit();
+
+void jit_seal();
+
+#ifdef JIT
+
+// calls before a function gets compiled.
+#define JIT_THRESHOLD 64
+
+// Runs frame from entry, the native code of one of its instructions, until it has to return a status.
+typedef JitStatus (*NativeCode)(CallFrame *frame, void *entry);
+
+typedef struct JitCode {
+    NativeCode code;
+    // the native code of each instruction by bytecode offset, NULL inside an instruction.
+    void **entries;
+    int entry_count;
+    void *memory;
+    size_t size;
+} JitCode;
+
+// set by jit_enable(), before that nothing gets compiled.
+extern bool jit_enabled;
+
+void jit_enable();
+
+void jit_compile(ObjFunction *function);
+
+void jit_free(ObjFunction *function);
+
+JitStatus jit_run();
+
+#endif
+
+#endif //CLOX_JIT_H
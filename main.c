@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <execinfo.h>
 #include <signal.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "compiler.h"
 #include "vm.h"
+#include "jit.h"
+#include "aot.h"
+#include "output.h"
 
 void handler(int sig) {
     void *array[10];
@@ -69,21 +74,66 @@ static void run_file(const char *path) {
     InterpretResult result = interpret(source);
 }
 
+// writes the script out as C instead of running it, see aot.h.
+static void emit_c(const char *path) {
+    char *source = read_file(path);
+    bool compiled = aot_compile(source, stdout);
+    free(source);
+    if (!compiled) {
+        exit(65);
+    }
+}
+
+static void usage() {
+#ifdef JIT
+    fprintf(stderr, "Usage: clox [--backend=stack|register] [--jit] [--line-buffered] [path]\n");
+#else
+    fprintf(stderr, "Usage: clox [--backend=stack|register] [--line-buffered] [path]\n");
+#endif
+    fprintf(stderr, "       clox [--backend=stack|register] --emit-c path\n");
+    exit(64);
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGSEGV, handler);
 
+    const char *path = NULL;
+    bool emit = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--backend=stack") == 0) {
+            set_backend(BACKEND_STACK);
+        } else if (strcmp(argv[i], "--backend=register") == 0) {
+            set_backend(BACKEND_REGISTER);
+#ifdef JIT
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit_enable();
+#endif
+        } else if (strcmp(argv[i], "--line-buffered") == 0) {
+            set_line_buffered();
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit = true;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (emit && path == NULL) {
+        usage();
+    }
+
     init_virtual_machine();
 
-    if (argc == 1) {
+    if (emit) {
+        emit_c(path);
+    } else if (path == NULL) {
         // repl();
         // benchmark
         run_file("/Users/ocowchun/CLionProjects/c-lox/test.lox");
 
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        run_file(path);
     }
 
     free_virtual_machine();
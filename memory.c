@@ -8,6 +8,7 @@
 #include "object.h"
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
 
 #ifdef DEBUG_LOG_GC
 
@@ -105,12 +106,21 @@ static void blacken_object(Obj *object) {
             ObjClass *klass = (ObjClass *) object;
             mark_object((Obj *) klass->name);
             mark_table(&klass->methods);
+            mark_object((Obj *) klass->superclass);
+            mark_object((Obj *) klass->initializer);
+            mark_object((Obj *) klass->root_shape);
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) object;
             mark_object((Obj *) instance->klass);
-            mark_table(&instance->fields);
+            mark_object((Obj *) instance->shape);
+            if (instance->shape != NULL) {
+                for (int i = 0; i < instance->shape->field_count; ++i) {
+                    mark_value(instance->fields[i]);
+                }
+            }
+            mark_table(&instance->dictionary);
             break;
         }
         case OBJ_UPVALUE: {
@@ -122,7 +132,19 @@ static void blacken_object(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             mark_object((Obj *) function->name);
+            mark_object((Obj *) function->closure);
             mark_array(&function->chunk.constants);
+            // the caches hold on to what they point at, so a freed class's address can't be mistaken for a hit.
+            for (int i = 0; i < function->chunk.inline_cache_count; ++i) {
+                for (int j = 0; j < INLINE_CACHE_WAYS; ++j) {
+                    InlineCacheEntry *entry = &function->chunk.inline_caches[i].entries[j];
+                    mark_object((Obj *) entry->klass);
+                    mark_object((Obj *) entry->method);
+                }
+            }
+            for (int i = 0; i < function->chunk.property_cache_count; ++i) {
+                mark_object((Obj *) function->chunk.property_caches[i].shape);
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -133,8 +155,21 @@ static void blacken_object(Obj *object) {
             }
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) object;
+            for (int i = 0; i < shape->field_count; ++i) {
+                mark_object((Obj *) shape->keys[i]);
+            }
+            mark_table(&shape->transitions);
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString *string = (ObjString *) object;
+            mark_object((Obj *) string->left);
+            mark_object((Obj *) string->right);
+            break;
+        }
         case OBJ_NATIVE:
-        case OBJ_STRING:
             break;
     }
 }
@@ -156,22 +191,34 @@ static void free_object(Obj *obj) {
         }
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *) obj;
-            free_table(&instance->fields);
-            FREE(ObjInstance, obj);
+            if (instance->fields != instance->inline_fields) {
+                FREE_ARRAY(Value, instance->fields, instance->field_capacity);
+            }
+            free_table(&instance->dictionary);
+            reallocate(obj, sizeof(ObjInstance) + sizeof(Value) * instance->inline_capacity, 0);
             break;
         }
         case OBJ_UPVALUE: {
             FREE(ObjUpvalue, obj);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape *shape = (ObjShape *) obj;
+            FREE_ARRAY(ObjString*, shape->keys, shape->field_count);
+            free_table(&shape->transitions);
+            FREE(ObjShape, obj);
+            break;
+        }
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *) obj;
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-            FREE(ObjClosure, obj);
+            reallocate(obj, sizeof(ObjClosure) + sizeof(ObjUpvalue *) * closure->upvalue_count, 0);
             break;
         }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) obj;
+#ifdef JIT
+            jit_free(function);
+#endif
             free_chunk(&function->chunk);
             FREE(ObjFunction, obj);
             break;
@@ -182,8 +229,8 @@ static void free_object(Obj *obj) {
         }
         case OBJ_STRING: {
             ObjString *string = (ObjString *) obj;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, obj);
+            // a rope has no storage.
+            reallocate(obj, sizeof(ObjString) + (string->left != NULL ? 0 : string->length + 1), 0);
             break;
         }
     }
@@ -202,7 +249,9 @@ static void mark_roots() {
         mark_object((Obj *) upvalue);
     }
 
-    mark_table(&vm.globals);
+    mark_table(&vm.global_slots);
+    mark_array(&vm.global_names);
+    mark_array(&vm.global_values);
     mark_compiler_roots();
     mark_object((Obj *) vm.init_string);
 }
@@ -260,6 +309,8 @@ void collect_garbage() {
     trace_references();
     table_remove_white(&vm.strings);
     sweep();
+    // after the sweep, so that a collection started by its allocation is a collection of its own.
+    table_compact(&vm.strings);
 
     vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
 
@@ -268,5 +319,7 @@ void collect_garbage() {
     printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
            before - vm.bytes_allocated, before, vm.bytes_allocated,
            vm.next_gc);
+    print_table_stats(&vm.strings, "strings");
+    print_table_stats(&vm.global_slots, "globals");
 #endif
 }
@@ -0,0 +1,15 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef C_LOX_NUMBER_H
+#define C_LOX_NUMBER_H
+
+#include "common.h"
+
+// room for a sign, 17 digits, a point, up to 5 leading zeros or an exponent, and a terminator.
+#define NUMBER_BUFFER_SIZE 32
+
+int format_number(double number, char *buffer);
+
+#endif //C_LOX_NUMBER_H
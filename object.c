@@ -3,6 +3,7 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -37,15 +38,22 @@ ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method) {
 }
 
 ObjClosure *new_closure(ObjFunction *function) {
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
-    for (int i = 0; i < function->upvalue_count; ++i) {
-        upvalues[i] = NULL;
+    // a closure capturing nothing holds nothing but its function, so they all can be the same one.
+    if (function->upvalue_count == 0 && function->closure != NULL) {
+        return function->closure;
     }
 
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure *closure = (ObjClosure *) allocate_object(
+        sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalue_count, OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    closure->frame_base = 0;
+    for (int i = 0; i < function->upvalue_count; ++i) {
+        closure->upvalues[i] = NULL;
+    }
+    if (function->upvalue_count == 0) {
+        function->closure = closure;
+    }
     return closure;
 }
 
@@ -53,38 +61,94 @@ ObjFunction *new_function() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->slot_count = 0;
+    function->stack_size = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->compiled = NULL;
+#ifdef JIT
+    function->call_count = 0;
+    function->jit = NULL;
+    function->traces = NULL;
+#endif
     init_chunk(&function->chunk);
     return function;
 }
 
-ObjNative *new_native(NativeFn function) {
+ObjNative *new_native(NativeFn function, int arity) {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+/**
+ * Makes a flat string of length characters, stored along with it, for the caller to fill in. It isn't hashed or
+ * interned: copy_string() does that for the names and literals the tables are keyed by, while a string made at
+ * runtime compares by its characters, see strings_equal().
+ */
+ObjString *new_string(int length) {
+    ObjString *string = (ObjString *) allocate_object(sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->hash = 0;
+    string->chars = string->storage;
+    string->chars[length] = '\0';
+    string->interned = false;
+    string->left = NULL;
+    string->right = NULL;
+    return string;
+}
 
-    push(OBJ_VAL(string));
-    table_set(&vm.strings, string, NIL_VAL);
-    pop();
+static inline uint64_t load_word(const char *chars) {
+    uint64_t word;
+    memcpy(&word, chars, sizeof(word));
+    return word;
+}
 
-    return string;
+static inline uint64_t mix_word(uint64_t hash, uint64_t word, uint64_t multiplier) {
+    hash = (hash ^ word) * multiplier;
+    return hash ^ (hash >> 29);
 }
 
+/**
+ * Hashes key eight bytes at a time, in two lanes so consecutive multiplies don't wait on each other, instead of
+ * FNV-1a's one byte at a time. The lanes and the length get folded together and mixed at the end, so every byte
+ * reaches the low bits a table indexes by.
+ */
 static uint32_t hash_string(const char *key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; ++i) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+    uint64_t a = 0x9e3779b97f4a7c15u ^ (uint64_t) length;
+    uint64_t b = 0xc2b2ae3d27d4eb4fu;
+    int i = 0;
+    for (; i + 16 <= length; i += 16) {
+        a = mix_word(a, load_word(key + i), 0xff51afd7ed558ccdu);
+        b = mix_word(b, load_word(key + i + 8), 0xc4ceb9fe1a85ec53u);
+    }
+    if (i + 8 <= length) {
+        a = mix_word(a, load_word(key + i), 0xff51afd7ed558ccdu);
+        i += 8;
+    }
+    if (i < length) {
+        // the last few bytes, read with loads overlapping what came before; the length is already in the seed.
+        uint64_t word;
+        if (length >= 8) {
+            word = load_word(key + length - 8);
+        } else if (length >= 4) {
+            uint32_t low, high;
+            memcpy(&low, key, sizeof(low));
+            memcpy(&high, key + length - 4, sizeof(high));
+            word = low | (uint64_t) high << 32;
+        } else {
+            word = (uint8_t) key[0] | (uint64_t) (uint8_t) key[length / 2] << 8 |
+                   (uint64_t) (uint8_t) key[length - 1] << 16;
+        }
+        b = mix_word(b, word, 0xc4ceb9fe1a85ec53u);
     }
 
-    return hash;
+    uint64_t hash = a ^ (b * 0x9e3779b97f4a7c15u);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdu;
+    hash ^= hash >> 33;
+    return (uint32_t) hash;
 }
 
 ObjString *copy_string(const char *chars, int length) {
@@ -94,10 +158,16 @@ ObjString *copy_string(const char *chars, int length) {
         return interned;
     }
 
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    ObjString *string = new_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->interned = true;
+
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+
+    return string;
 }
 
 ObjUpvalue *new_upvalue(Value *slot) {
@@ -108,52 +178,278 @@ ObjUpvalue *new_upvalue(Value *slot) {
     return upvalue;
 }
 
+static ObjShape *new_shape() {
+    ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->keys = NULL;
+    shape->field_count = 0;
+    init_table(&shape->transitions);
+    return shape;
+}
+
 ObjClass *new_class(ObjString *name) {
     ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     init_table(&klass->methods);
+    klass->superclass = NULL;
+    klass->initializer = NULL;
+    klass->root_shape = NULL;
+    klass->instance_slots = 0;
+    klass->version = 0;
+    klass->shadowed = false;
+
+    push(OBJ_VAL(klass));
+    klass->root_shape = new_shape();
+    pop();
     return klass;
 }
 
 ObjInstance *new_instance(ObjClass *klass) {
-    ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inline_capacity = klass->instance_slots;
+    ObjInstance *instance = (ObjInstance *) allocate_object(
+        sizeof(ObjInstance) + sizeof(Value) * inline_capacity, OBJ_INSTANCE);
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = klass->root_shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = inline_capacity;
+    instance->inline_capacity = inline_capacity;
+    init_table(&instance->dictionary);
     return instance;
 }
 
+/**
+ * Marks klass shadowed when one of its instances gets a field named like one of its methods.
+ */
+static void check_shadowing(ObjClass *klass, ObjString *name) {
+    Value method;
+    if (!klass->shadowed && table_get(&klass->methods, name, &method)) {
+        // cached OP_INVOKE call sites would miss the field.
+        klass->shadowed = true;
+        klass->version++;
+    }
+}
+
+/**
+ * Returns the shape shape leads to when name is added, or NULL if the instance should go to dictionary mode instead.
+ */
+static ObjShape *shape_transition(ObjClass *klass, ObjShape *shape, ObjString *name) {
+    Value next;
+    if (table_get(&shape->transitions, name, &next)) {
+        return (ObjShape *) AS_OBJ(next);
+    }
+
+    if (shape->field_count == SHAPE_MAX_FIELDS || shape->transitions.count == SHAPE_MAX_TRANSITIONS) {
+        return NULL;
+    }
+
+    // shapes are per class, so this runs once per class and field order, not once per instance.
+    check_shadowing(klass, name);
+
+    ObjShape *child = new_shape();
+    push(OBJ_VAL(child));
+    int field_count = shape->field_count + 1;
+    child->keys = ALLOCATE(ObjString*, field_count);
+    for (int slot = 0; slot < shape->field_count; ++slot) {
+        child->keys[slot] = shape->keys[slot];
+    }
+    child->keys[shape->field_count] = name;
+    child->field_count = field_count;
+    table_set(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+static void to_dictionary(ObjInstance *instance) {
+    ObjShape *shape = instance->shape;
+    for (int slot = 0; slot < shape->field_count; ++slot) {
+        table_set(&instance->dictionary, shape->keys[slot], instance->fields[slot]);
+    }
+
+    instance->shape = NULL;
+    if (instance->fields != instance->inline_fields) {
+        FREE_ARRAY(Value, instance->fields, instance->field_capacity);
+        instance->fields = instance->inline_fields;
+        instance->field_capacity = instance->inline_capacity;
+    }
+}
+
+/**
+ * Sets field name of instance to value, which the caller keeps reachable. Returns true if the field is new.
+ */
+bool instance_set_field(ObjInstance *instance, ObjString *name, Value value) {
+    ObjShape *shape = instance->shape;
+    if (shape != NULL) {
+        for (int slot = 0; slot < shape->field_count; ++slot) {
+            if (shape->keys[slot] == name) {
+                instance->fields[slot] = value;
+                return false;
+            }
+        }
+
+        ObjShape *next = shape_transition(instance->klass, shape, name);
+        if (next != NULL) {
+            if (instance->field_capacity < next->field_count) {
+                int old_capacity = instance->field_capacity;
+                int capacity = GROW_CAPACITY(old_capacity);
+                if (instance->fields == instance->inline_fields) {
+                    Value *fields = ALLOCATE(Value, capacity);
+                    memcpy(fields, instance->inline_fields, sizeof(Value) * shape->field_count);
+                    instance->fields = fields;
+                } else {
+                    instance->fields = GROW_ARRAY(Value, instance->fields, old_capacity, capacity);
+                }
+                instance->field_capacity = capacity;
+            }
+
+            instance->fields[shape->field_count] = value;
+            instance->shape = next;
+            if (instance->klass->instance_slots < next->field_count) {
+                instance->klass->instance_slots = next->field_count;
+            }
+            return true;
+        }
+
+        to_dictionary(instance);
+    }
+
+    bool is_new = table_set(&instance->dictionary, name, value);
+    if (is_new) {
+        check_shadowing(instance->klass, name);
+    }
+    return is_new;
+}
+
 static void print_function(ObjFunction *function) {
     if (function->name == NULL) {
-        printf("<script>");
+        write_output("<script>", 8);
         return;
     }
 
-    printf("<fn %s>", function->name->chars);
+    write_output("<fn ", 4);
+    write_output(function->name->chars, function->name->length);
+    write_output(">", 1);
 }
 
-ObjString *take_string(char *chars, int length) {
-    uint32_t hash = hash_string(chars, length);
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+/**
+ * Makes the concatenation of left and right without copying either, for strings of ROPE_MIN_LENGTH or more.
+ */
+ObjString *new_rope(ObjString *left, ObjString *right) {
+    // no characters of its own, those of the flat copy are kept in left.
+    ObjString *rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    rope->length = left->length + right->length;
+    rope->chars = NULL;
+    rope->hash = 0;
+    rope->interned = false;
+    rope->left = left;
+    rope->right = right;
+    return rope;
+}
+
+typedef void (*StringPartFn)(const char *chars, int length, void *context);
+
+/**
+ * Calls write with each flat part of string in order. The parts still to come wait on a stack outside of the GC's
+ * accounting, so walking a rope never collects.
+ */
+static void for_each_part(ObjString *string, StringPartFn write, void *context) {
+    int capacity = 8;
+    int count = 0;
+    ObjString **rest = (ObjString **) malloc(sizeof(ObjString *) * capacity);
+    if (rest == NULL) {
+        exit(1);
+    }
+
+    for (;;) {
+        while (string->chars == NULL) {
+            if (count == capacity) {
+                capacity *= 2;
+                rest = (ObjString **) realloc(rest, sizeof(ObjString *) * capacity);
+                if (rest == NULL) {
+                    exit(1);
+                }
+            }
+            rest[count++] = string->right;
+            string = string->left;
+        }
+        write(string->chars, string->length, context);
+        if (count == 0) {
+            break;
+        }
+        string = rest[--count];
+    }
+    free(rest);
+}
+
+static void append_part(const char *chars, int length, void *context) {
+    char **end = (char **) context;
+    memcpy(*end, chars, length);
+    *end += length;
+}
+
+static void print_part(const char *chars, int length, void *context) {
+    write_output(chars, length);
+}
+
+/**
+ * Copies the characters of a rope into a flat string, which it keeps in left in place of the strings it joins.
+ */
+void flatten_string(ObjString *string) {
+    if (string->chars != NULL) {
+        return;
+    }
+
+    push(OBJ_VAL(string));
+    ObjString *flat = new_string(string->length);
+    pop();
+
+    char *end = flat->chars;
+    for_each_part(string, append_part, &end);
+    string->left = flat;
+    string->right = NULL;
+    string->chars = flat->chars;
+}
+
+/**
+ * Compares two string objects by their characters. Two interned ones are the same object if they are equal,
+ * so only a rope or a string made at runtime takes comparing the characters.
+ */
+bool strings_equal(ObjString *a, ObjString *b) {
+    if (a == b) {
+        return true;
+    }
+    if (a->length != b->length || (a->interned && b->interned)) {
+        return false;
     }
 
-    return allocate_string(chars, length, hash);
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    flatten_string(a);
+    flatten_string(b);
+    pop();
+    pop();
+    return memcmp(a->chars, b->chars, a->length) == 0;
 }
 
 void print_object(const Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
             print_function(AS_BOUND_METHOD(value)->method->function);
-        case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
             break;
-        case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+        case OBJ_CLASS: {
+            ObjString *name = AS_CLASS(value)->name;
+            write_output(name->chars, name->length);
             break;
+        }
+        case OBJ_INSTANCE: {
+            ObjString *name = AS_INSTANCE(value)->klass->name;
+            write_output(name->chars, name->length);
+            write_output(" instance", 9);
+            break;
+        }
         case OBJ_UPVALUE:
-            printf("upvalue");
+            write_output("upvalue", 7);
+            break;
+        case OBJ_SHAPE:
+            write_output("shape", 5);
             break;
         case OBJ_CLOSURE:
             print_function(AS_CLOSURE(value)->function);
@@ -162,10 +458,17 @@ void print_object(const Value value) {
             print_function(AS_FUNCTION(value));
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            write_output("<native fn>", 11);
             break;
-        case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_STRING: {
+            ObjString *string = AS_STRING(value);
+            if (string->chars != NULL) {
+                write_output(string->chars, string->length);
+            } else {
+                // a rope prints part by part, printing doesn't flatten it.
+                for_each_part(string, print_part, NULL);
+            }
             break;
+        }
     }
 }
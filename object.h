@@ -10,6 +10,8 @@
 #include "table.h"
 #include "value.h"
 
+struct CallFrame;
+
 typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
@@ -19,6 +21,7 @@ typedef enum {
     OBJ_FUNCTION,
     OBJ_CLOSURE,
     OBJ_UPVALUE,
+    OBJ_SHAPE,
 } ObjType;
 
 struct Obj {
@@ -50,10 +53,24 @@ struct Obj {
 struct ObjString {
     Obj obj;
     int length;
+    // storage, or for a rope, NULL until something needs its characters in one piece, see flatten_string().
     char *chars;
+    // set for an interned string only.
     uint32_t hash;
+    // whether this is the string vm.strings holds for its characters. Only names and literals are interned up
+    // front, any other string may equal a different string object, see strings_equal().
+    bool interned;
+    // the two strings a rope joins, or once it is flattened, the flat copy in left. NULL for any other string.
+    struct ObjString *left;
+    struct ObjString *right;
+    // the characters of a flat string, allocated along with it.
+    char storage[];
 };
 
+// A concatenation at least this long makes a rope, which puts off copying the characters until they are needed.
+// Anything shorter is always flat.
+#define ROPE_MIN_LENGTH 64
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value *location;
@@ -65,28 +82,81 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    // the most locals in scope at once, slot zero included.
+    int slot_count;
+    // the most values its frame holds at once, slot zero and the locals included, which call() makes room for.
+    int stack_size;
     Chunk chunk;
     ObjString *name;
+    // the closure every OP_CLOSURE of the function shares when it captures nothing, NULL until one is made.
+    struct ObjClosure *closure;
+    // the C aot.c compiled the function to ahead of time, which runs in place of run(). NULL unless loaded by aot_main().
+    bool (*compiled)(struct CallFrame *frame);
+#ifdef JIT
+    // calls so far, the function gets compiled when this reaches JIT_THRESHOLD.
+    int call_count;
+    // the native code, NULL until the function is compiled.
+    struct JitCode *jit;
+    // the loops of the function that got hot enough to be traced, see trace_loop().
+    struct Trace *traces;
+#endif
 } ObjFunction;
 
 typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
-    // a pointer to a dynamically allocated array of pointers to upvalues
-    ObjUpvalue **upvalues;
     int upvalue_count;
+    // where the slots of the frame that created the closure start in vm.stack, for OP_GET_ENCLOSING.
+    int frame_base;
+    // allocated along with the closure.
+    ObjUpvalue *upvalues[];
 } ObjClosure;
 
+// Instances with the same fields, added in the same order, share a shape, which maps each field name to a slot.
+// Adding a field moves an instance along a transition to the shape with one more field.
+typedef struct ObjShape {
+    Obj obj;
+    // the name of the field in each slot.
+    ObjString **keys;
+    int field_count;
+    // the shapes one field away, by the name of that field.
+    Table transitions;
+} ObjShape;
+
+// An instance leaves shapes for dictionary mode once it has more fields than this,
+// or would need a new transition from a shape that already has this many.
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 16
+
 typedef struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
+    struct ObjClass *superclass;
+    // the init method, resolved once the class is sealed so constructing an instance doesn't look it up.
+    ObjClosure *initializer;
+    // the shape of a new instance, with no fields.
+    ObjShape *root_shape;
+    // the inline field slots given to new instances, the most fields an instance of the class had so far.
+    int instance_slots;
+    // bumped whenever methods changes, or a method gets shadowed, which invalidates the inline caches holding the class.
+    uint32_t version;
+    // whether an instance has a field named like one of the methods, so its methods can't be cached for OP_INVOKE.
+    bool shadowed;
 } ObjClass;
 
 typedef struct ObjInstance {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    // NULL once the instance is in dictionary mode.
+    ObjShape *shape;
+    // the field values by slot; points at inline_fields until the instance outgrows them.
+    Value *fields;
+    int field_capacity;
+    int inline_capacity;
+    // the fields of an instance in dictionary mode.
+    Table dictionary;
+    Value inline_fields[];
 } ObjInstance;
 
 typedef struct ObjBoundMethod {
@@ -100,19 +170,26 @@ typedef Value (*NativeFn)(int arg_count, Value *args);
 typedef struct {
     Obj obj;
     NativeFn function;
+    int arity;
 } ObjNative;
 
 ObjString *copy_string(const char *chars, int length);
 
 ObjUpvalue *new_upvalue(Value *slot);
 
-ObjString *take_string(char *chars, int length);
+ObjString *new_string(int length);
+
+ObjString *new_rope(ObjString *left, ObjString *right);
+
+void flatten_string(ObjString *string);
+
+bool strings_equal(ObjString *a, ObjString *b);
 
 ObjClosure *new_closure(ObjFunction *function);
 
 ObjFunction *new_function();
 
-ObjNative *new_native(NativeFn function);
+ObjNative *new_native(NativeFn function, int arity);
 
 ObjClass *new_class(ObjString *name);
 
@@ -120,6 +197,8 @@ ObjInstance *new_instance(ObjClass *klass);
 
 ObjBoundMethod *new_bound_method(Value receiver, ObjClosure *method);
 
+bool instance_set_field(ObjInstance *instance, ObjString *name, Value value);
+
 void print_object(Value value);
 
 
@@ -127,4 +206,20 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+static inline bool instance_get_field(ObjInstance *instance, ObjString *name, Value *value) {
+    ObjShape *shape = instance->shape;
+    if (shape == NULL) {
+        return table_get(&instance->dictionary, name, value);
+    }
+
+    for (int slot = 0; slot < shape->field_count; ++slot) {
+        if (shape->keys[slot] == name) {
+            *value = instance->fields[slot];
+            return true;
+        }
+    }
+
+    return false;
+}
+
 #endif //CLOX_OBJECT_H
@@ -0,0 +1,148 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "vm.h"
+
+static bool line_buffered_requested = false;
+
+/**
+ * Makes the output flush at the end of every line even if standard output isn't a terminal.
+ */
+void set_line_buffered() {
+    line_buffered_requested = true;
+}
+
+void init_output(Output *output) {
+    // like the stack, the buffer isn't an object and lives outside of the GC's accounting.
+    output->chars = (char *) malloc(OUTPUT_CAPACITY);
+    if (output->chars == NULL) {
+        exit(1);
+    }
+    output->count = 0;
+    output->line_buffered = line_buffered_requested || isatty(STDOUT_FILENO);
+    output->capture = NULL;
+}
+
+/**
+ * Writes count buffers to standard output, all of them unless it fails. Anything after a failure, like a closed
+ * pipe, is dropped.
+ */
+static void write_all(struct iovec *parts, int count) {
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, parts, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        while (count > 0 && (size_t) written >= parts->iov_len) {
+            written -= (ssize_t) parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = (char *) parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+}
+
+static void flush(Output *output) {
+    if (output->count == 0) {
+        return;
+    }
+
+    // whatever went through stdio was written before.
+    fflush(stdout);
+    struct iovec part = {output->chars, (size_t) output->count};
+    write_all(&part, 1);
+    output->count = 0;
+}
+
+void free_output(Output *output) {
+    flush(output);
+    free(output->chars);
+    output->chars = NULL;
+}
+
+static void append_capture(Capture *capture, const char *chars, int length) {
+    if (capture->count + length > capture->capacity) {
+        // realloc() rather than reallocate(), which could collect while the characters are on their way to a string.
+        while (capture->count + length > capture->capacity) {
+            capture->capacity = capture->capacity < 8 ? 8 : capture->capacity * 2;
+        }
+        capture->chars = (char *) realloc(capture->chars, capture->capacity);
+        if (capture->chars == NULL) {
+            exit(1);
+        }
+    }
+    memcpy(capture->chars + capture->count, chars, length);
+    capture->count += length;
+}
+
+/**
+ * Appends length characters to the output, which goes out once the buffer fills, at the end of a line when line
+ * buffered, on a runtime error, on flush_output() and when the VM is freed. A capture takes them instead, see
+ * begin_capture().
+ */
+void write_output(const char *chars, int length) {
+    if (vm.output.capture != NULL) {
+        append_capture(vm.output.capture, chars, length);
+        return;
+    }
+
+#ifdef OUTPUT_THROUGH_STDIO
+    fwrite(chars, 1, length, stdout);
+#else
+    Output *output = &vm.output;
+    if (output->count + length <= OUTPUT_CAPACITY) {
+        memcpy(output->chars + output->count, chars, length);
+        output->count += length;
+    } else {
+        // what is buffered and the characters that don't fit, in one system call.
+        fflush(stdout);
+        struct iovec parts[] = {{output->chars, (size_t) output->count}, {(void *) chars, (size_t) length}};
+        write_all(parts, 2);
+        output->count = 0;
+        return;
+    }
+
+    if (output->line_buffered && memchr(chars, '\n', length) != NULL) {
+        flush(output);
+    }
+#endif
+}
+
+void flush_output() {
+#ifdef OUTPUT_THROUGH_STDIO
+    fflush(stdout);
+#else
+    flush(&vm.output);
+#endif
+}
+
+/**
+ * Collects what write_output() writes in capture instead, until end_capture(). That is how str() gets the characters
+ * print_value() writes. The caller frees capture->chars.
+ */
+void begin_capture(Capture *capture) {
+    capture->chars = NULL;
+    capture->count = 0;
+    capture->capacity = 0;
+    vm.output.capture = capture;
+}
+
+void end_capture() {
+    vm.output.capture = NULL;
+}
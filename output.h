@@ -0,0 +1,50 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef C_LOX_OUTPUT_H
+#define C_LOX_OUTPUT_H
+
+#include "common.h"
+
+#define OUTPUT_CAPACITY (64 * 1024)
+
+// The DEBUG_ diagnostics print through stdio as they go, so a build with any of them writes the output of print that
+// way too, to keep the two in order.
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_PRINT_FUSIONS) || \
+    defined(DEBUG_PRINT_TRACES) || defined(DEBUG_LOG_GC)
+#define OUTPUT_THROUGH_STDIO
+#endif
+
+// What write_output() collects in place of printing it, see begin_capture().
+typedef struct {
+    char *chars;
+    int count;
+    int capacity;
+} Capture;
+
+typedef struct {
+    // what print wrote that hasn't gone to standard output yet, OUTPUT_CAPACITY bytes.
+    char *chars;
+    int count;
+    // whether to flush at the end of every line rather than once the buffer fills, for a terminal.
+    bool line_buffered;
+    // where write_output() goes between begin_capture() and end_capture(), NULL otherwise.
+    Capture *capture;
+} Output;
+
+void set_line_buffered();
+
+void init_output(Output *output);
+
+void free_output(Output *output);
+
+void write_output(const char *chars, int length);
+
+void flush_output();
+
+void begin_capture(Capture *capture);
+
+void end_capture();
+
+#endif //C_LOX_OUTPUT_H
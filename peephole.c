@@ -0,0 +1,138 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+typedef struct {
+    // the sequence being replaced, one opcode per instruction.
+    uint8_t sequence[4];
+    int sequence_length;
+    OP_CODE superinstruction;
+    const char *name;
+} Fusion;
+
+static const Fusion fusions[] = {
+    {{OP_GET_LOCAL, OP_GET_LOCAL, OP_LESS, OP_JUMP_IF_FALSE}, 4, OP_LESS_LOCAL_LOCAL_JUMP, "OP_LESS_LOCAL_LOCAL_JUMP"},
+    {{OP_GET_LOCAL, OP_LESS_SMALL, OP_JUMP_IF_FALSE}, 3, OP_LESS_LOCAL_SMALL_JUMP, "OP_LESS_LOCAL_SMALL_JUMP"},
+    {{OP_GET_LOCAL, OP_LESS_CONSTANT, OP_JUMP_IF_FALSE}, 3, OP_LESS_LOCAL_CONSTANT_JUMP, "OP_LESS_LOCAL_CONSTANT_JUMP"},
+    {{OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD}, 3, OP_ADD_LOCAL_LOCAL, "OP_ADD_LOCAL_LOCAL"},
+    {{OP_GET_LOCAL, OP_GET_PROPERTY}, 2, OP_GET_LOCAL_PROPERTY, "OP_GET_LOCAL_PROPERTY"},
+};
+
+#define FUSION_COUNT (int) (sizeof(fusions) / sizeof(fusions[0]))
+
+/**
+ * Returns the name of instruction if it is a superinstruction, otherwise NULL.
+ */
+const char *superinstruction_name(uint8_t instruction) {
+    for (int i = 0; i < FUSION_COUNT; ++i) {
+        if (fusions[i].superinstruction == instruction) {
+            return fusions[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the first instruction of the sequence instruction replaced if it is a superinstruction, otherwise instruction.
+ * The rest of the sequence still follows it in the chunk, unchanged.
+ */
+uint8_t unfused_instruction(uint8_t instruction) {
+    for (int i = 0; i < FUSION_COUNT; ++i) {
+        if (fusions[i].superinstruction == instruction) {
+            return fusions[i].sequence[0];
+        }
+    }
+
+    return instruction;
+}
+
+/**
+ * Returns the instruction the code at offset stands for when compiled to native code, and its length in *length:
+ * the generic op for a quickened form, and the first instruction of the sequence for a superinstruction.
+ */
+uint8_t decode_instruction(Chunk *chunk, int offset, int *length) {
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+        // quickened forms compile as the generic op, which has its own fast path.
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            *length = 1;
+            return OP_ADD;
+        case OP_GET_PROPERTY_CACHED:
+            *length = instruction_length(chunk, offset);
+            return OP_GET_PROPERTY;
+        default:
+            break;
+    }
+
+    uint8_t unfused = unfused_instruction(instruction);
+    if (unfused != instruction) {
+        // the rest of the sequence follows, and is compiled, as it was before fusing.
+        // Every superinstruction starts with an OP_GET_LOCAL.
+        *length = 2;
+        return unfused;
+    }
+
+    *length = instruction_length(chunk, offset);
+    return instruction;
+}
+
+/**
+ * Tries to match fusion at offset. On success returns the length in bytes of the matched sequence, otherwise 0.
+ * A sequence only matches if no jump lands inside it, because its tail won't be executed anymore.
+ */
+static int match_fusion(Chunk *chunk, const bool *is_target, int offset, const Fusion *fusion) {
+    int position = offset;
+    for (int i = 0; i < fusion->sequence_length; ++i) {
+        if (position >= chunk->count || chunk->code[position] != fusion->sequence[i]) {
+            return 0;
+        }
+        if (i > 0 && is_target[position]) {
+            return 0;
+        }
+        position += instruction_length(chunk, position);
+    }
+
+    return position - offset;
+}
+
+/**
+ * Rewrites recurring instruction sequences into superinstructions, in place.
+ * The first byte of the sequence becomes the superinstruction and the remaining bytes are kept as its operands,
+ * so code size, jump offsets and line information stay untouched while the VM dispatches once instead of several times.
+ */
+void fuse_superinstructions(Chunk *chunk) {
+    if (chunk->count == 0) {
+        return;
+    }
+
+    bool *is_target = ALLOCATE(bool, chunk->count + 1);
+    memset(is_target, 0, sizeof(bool) * (chunk->count + 1));
+
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        int target = jump_target(chunk, offset);
+        if (target >= 0 && target <= chunk->count) {
+            is_target[target] = true;
+        }
+    }
+
+    for (int offset = 0; offset < chunk->count;) {
+        int length = 0;
+        for (int i = 0; i < FUSION_COUNT && length == 0; ++i) {
+            length = match_fusion(chunk, is_target, offset, &fusions[i]);
+            if (length != 0) {
+                chunk->code[offset] = fusions[i].superinstruction;
+            }
+        }
+
+        offset += length != 0 ? length : instruction_length(chunk, offset);
+    }
+
+    FREE_ARRAY(bool, is_target, chunk->count + 1);
+}
@@ -0,0 +1,18 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef CLOX_PEEPHOLE_H
+#define CLOX_PEEPHOLE_H
+
+#include "chunk.h"
+
+void fuse_superinstructions(Chunk *chunk);
+
+const char *superinstruction_name(uint8_t instruction);
+
+uint8_t unfused_instruction(uint8_t instruction);
+
+uint8_t decode_instruction(Chunk *chunk, int offset, int *length);
+
+#endif //CLOX_PEEPHOLE_H
@@ -5,48 +5,147 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "object.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
 
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+#define GROUP_WIDTH 16
+#define CONTROL_EMPTY ((uint8_t) 0x80)
+#define CONTROL_DELETED ((uint8_t) 0xfe)
+
+/**
+ * A bit per slot of a group, set for the slots that matched; slot i is bit i * SLOT_STRIDE. SSE2 has movemask
+ * to pack one bit per byte, NEON has to narrow each byte to a nibble instead.
+ */
+typedef uint64_t GroupMask;
+
+#if defined(__SSE2__)
+#define SLOT_STRIDE 1
+
+static inline GroupMask match_byte(const uint8_t *group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i *) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte)));
+}
+
+static inline GroupMask match_free(const uint8_t *group) {
+    // empty and deleted are the only control bytes with the high bit set.
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SLOT_STRIDE 4
+
+static inline GroupMask to_group_mask(uint8x16_t matched) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matched), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888u;
+}
+
+static inline GroupMask match_byte(const uint8_t *group, uint8_t byte) {
+    return to_group_mask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMask match_free(const uint8_t *group) {
+    return to_group_mask(vtstq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+}
+#else
+#define SLOT_STRIDE 1
+
+static inline GroupMask match_byte(const uint8_t *group, uint8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i) {
+        mask |= (GroupMask) (group[i] == byte) << i;
+    }
+    return mask;
+}
+
+static inline GroupMask match_free(const uint8_t *group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i) {
+        mask |= (GroupMask) (group[i] >> 7) << i;
+    }
+    return mask;
+}
+#endif
+
+/**
+ * Returns the slot of the lowest match in mask and clears it.
+ */
+static inline int next_match(GroupMask *mask) {
+    int slot = __builtin_ctzll(*mask) / SLOT_STRIDE;
+    *mask &= *mask - 1;
+    return slot;
+}
+
+static inline uint8_t hash_tag(uint32_t hash) {
+    return hash & 0x7f;
+}
+
+static inline uint32_t group_mask(int capacity) {
+    return (uint32_t) capacity / GROUP_WIDTH - 1;
+}
 
 void init_table(Table *table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void free_table(Table *table) {
-    FREE_ARRAY(Entry, table->entries, table->count);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity);
     init_table(table);
 }
 
-static Entry *find_entry(Entry *entries, int capacity, ObjString *key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry *tombstone = NULL;
-    for (;;) {
-        Entry *entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) {
-                    tombstone = entry;
-                }
+/**
+ * Returns the index of key in the table, or -1 if it is not there. Groups are probed by triangular steps, which
+ * visit every group of a power-of-two table, and a probe ends at the first group with an empty slot: usually the
+ * first one, so a hit or a miss costs one compare of 16 control bytes and a key compare per tag that matched.
+ */
+static int find_entry(Table *table, ObjString *key) {
+    uint8_t tag = hash_tag(key->hash);
+    uint32_t mask = group_mask(table->capacity);
+    uint32_t group = (key->hash >> 7) & mask;
+    for (uint32_t step = 1;; ++step) {
+        const uint8_t *control = &table->control[group * GROUP_WIDTH];
+        GroupMask matches = match_byte(control, tag);
+        while (matches != 0) {
+            int index = group * GROUP_WIDTH + next_match(&matches);
+            // all strings used as keys are interned, so we only need to compare their address
+            if (table->entries[index].key == key) {
+                return index;
             }
-        } else if (entry->key == key) {
-            // all strings are interned, so we only need to compare their address
+        }
+        if (match_byte(control, CONTROL_EMPTY) != 0) {
+            return -1;
+        }
+
+        group = (group + step) & mask;
+    }
+}
 
-            // We found the key.
-            return entry;
+/**
+ * Returns the index of the first empty or deleted slot on key's probe sequence.
+ */
+static int find_free(uint8_t *control, int capacity, uint32_t hash) {
+    uint32_t mask = group_mask(capacity);
+    uint32_t group = (hash >> 7) & mask;
+    for (uint32_t step = 1;; ++step) {
+        GroupMask free = match_free(&control[group * GROUP_WIDTH]);
+        if (free != 0) {
+            return group * GROUP_WIDTH + next_match(&free);
         }
 
-        index = (index + 1) & (capacity - 1);
+        group = (group + step) & mask;
     }
 }
 
@@ -59,57 +158,82 @@ bool table_get(Table *table, ObjString *key, Value *value) {
         return false;
     }
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int index = find_entry(table, key);
+    if (index < 0) {
         return false;
     }
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 static void adjust_capacity(Table *table, int capacity) {
+    uint8_t *new_control = ALLOCATE(uint8_t, capacity);
     Entry *new_entries = ALLOCATE(Entry, capacity);
+    memset(new_control, CONTROL_EMPTY, capacity);
     for (int i = 0; i < capacity; ++i) {
         new_entries[i].key = NULL;
         new_entries[i].value = NIL_VAL;
     }
 
     table->count = 0;
+    table->tombstones = 0;
     for (int i = 0; i < table->capacity; ++i) {
         Entry *entry = &table->entries[i];
         if (entry->key == NULL) {
             continue;
         }
 
-        Entry *dest = find_entry(new_entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int index = find_free(new_control, capacity, entry->key->hash);
+        new_control[index] = hash_tag(entry->key->hash);
+        new_entries[index] = *entry;
         table->count++;
     }
 
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
 
     table->capacity = capacity;
+    table->control = new_control;
     table->entries = new_entries;
 }
 
+/**
+ * Returns the capacity that holds count entries at half the maximum load, so that a table resized to it takes a good
+ * part of its size in insertions or deletions before it resizes again.
+ */
+static int fitted_capacity(int count) {
+    int capacity = GROUP_WIDTH;
+    while (count > capacity * TABLE_MAX_LOAD / 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
 /**
  * returns true if a new entry was added.
  */
 bool table_set(Table *table, ObjString *key, Value value) {
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjust_capacity(table, capacity);
+        // tombstones count toward the load but not toward the size, so a table full of them is rehashed in place
+        // (or smaller) rather than doubled.
+        adjust_capacity(table, fitted_capacity(table->count - table->tombstones + 1));
     }
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value)) {
-        //  increment the count during insertion only if the new entry goes into an entirely empty bucket.
-        table->count++;
+    int index = find_entry(table, key);
+    bool is_new_key = index < 0;
+    if (is_new_key) {
+        index = find_free(table->control, table->capacity, key->hash);
+        if (table->control[index] == CONTROL_EMPTY) {
+            //  increment the count during insertion only if the new entry goes into an entirely empty bucket.
+            table->count++;
+        } else {
+            table->tombstones--;
+        }
+        table->control[index] = hash_tag(key->hash);
     }
 
+    Entry *entry = &table->entries[index];
     entry->key = key;
     entry->value = value;
     return is_new_key;
@@ -124,6 +248,21 @@ void table_add_all(Table *from, Table *to) {
     }
 }
 
+static void delete_entry(Table *table, int index) {
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+
+    // A probe stops at the first group with an empty slot, so no key was placed past a group that has one, and the
+    // slot can go back to empty rather than leave a tombstone.
+    if (match_byte(&table->control[index & ~(GROUP_WIDTH - 1)], CONTROL_EMPTY) != 0) {
+        table->control[index] = CONTROL_EMPTY;
+        table->count--;
+    } else {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+}
+
 /**
  * returns true if an entry was deleted.
  */
@@ -132,49 +271,130 @@ bool table_delete(Table *table, ObjString *key) {
         return false;
     }
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) {
+    int index = find_entry(table, key);
+    if (index < 0) {
         return false;
     }
 
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    delete_entry(table, index);
+    table_compact(table);
     return true;
 }
 
+/**
+ * Returns whether the 16 bytes at a and b are the same, in one vector compare where the target has one.
+ */
+static inline bool blocks_equal(const char *a, const char *b) {
+#if defined(__SSE2__)
+    __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a), _mm_loadu_si128((const __m128i *) b));
+    return _mm_movemask_epi8(equal) == 0xffff;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    return vminvq_u8(vceqq_u8(vld1q_u8((const uint8_t *) a), vld1q_u8((const uint8_t *) b))) == 0xff;
+#else
+    return memcmp(a, b, 16) == 0;
+#endif
+}
+
+static inline bool words_equal(const char *a, const char *b, size_t size) {
+    uint64_t x = 0;
+    uint64_t y = 0;
+    memcpy(&x, a, size);
+    memcpy(&y, b, size);
+    return x == y;
+}
+
+/**
+ * Compares the length bytes of a candidate key with the characters looked up, without a call to memcmp() for
+ * the short names most keys are. Past 16 bytes it goes a vector at a time, with the last block overlapping the
+ * one before instead of reading past the end; below that two overlapping words cover the bytes.
+ */
+static inline bool chars_equal(const char *a, const char *b, int length) {
+    if (length >= 16) {
+        for (int i = 0; i < length - 16; i += 16) {
+            if (!blocks_equal(a + i, b + i)) {
+                return false;
+            }
+        }
+        return blocks_equal(a + length - 16, b + length - 16);
+    }
+    if (length >= 8) {
+        return words_equal(a, b, 8) && words_equal(a + length - 8, b + length - 8, 8);
+    }
+    if (length >= 4) {
+        return words_equal(a, b, 4) && words_equal(a + length - 4, b + length - 4, 4);
+    }
+    return words_equal(a, b, length);
+}
+
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash) {
     if (table->count == 0) {
         return NULL;
     }
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) {
-                return NULL;
+    uint8_t tag = hash_tag(hash);
+    uint32_t mask = group_mask(table->capacity);
+    uint32_t group = (hash >> 7) & mask;
+    for (uint32_t step = 1;; ++step) {
+        const uint8_t *control = &table->control[group * GROUP_WIDTH];
+        GroupMask matches = match_byte(control, tag);
+        while (matches != 0) {
+            ObjString *key = table->entries[group * GROUP_WIDTH + next_match(&matches)].key;
+            if (key->length == length && key->hash == hash && chars_equal(key->chars, chars, length)) {
+                // We found it.
+                return key;
             }
-        } else if (entry->key->length == length && entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
+        }
+        // Stop at the first group with an empty slot.
+        if (match_byte(control, CONTROL_EMPTY) != 0) {
+            return NULL;
         }
 
-        index = (index + 1) & (table->capacity - 1);
+        group = (group + step) & mask;
     }
 }
 
+/**
+ * Leaves the table compacting to the caller: this runs in the middle of a collection, where allocating isn't safe.
+ */
 void table_remove_white(Table *table) {
     for (int i = 0; i < table->capacity; ++i) {
         Entry *entry = &table->entries[i];
         if (entry->key != NULL && !entry->key->obj.is_marked) {
-            table_delete(table, entry->key);
+            delete_entry(table, i);
         }
     }
 }
 
+/**
+ * Shrinks the table once its entries would fit at half the maximum load in half the capacity or less, and rehashes
+ * it at its size once a quarter of its slots are tombstones. Either takes a number of deletions proportional to the
+ * capacity, which pays for the rehash.
+ */
+void table_compact(Table *table) {
+    // the allocation in adjust_capacity() can start a collection, which compacts vm.strings in turn; leave that to us.
+    static bool compacting = false;
+    if (compacting || table->capacity == 0) {
+        return;
+    }
+
+    int capacity = fitted_capacity(table->count - table->tombstones);
+    if (capacity > table->capacity) {
+        capacity = table->capacity;
+    }
+    if (capacity < table->capacity || table->tombstones > table->capacity / 4) {
+        compacting = true;
+        adjust_capacity(table, capacity);
+        compacting = false;
+    }
+}
+
+void print_table_stats(Table *table, const char *name) {
+    int entries = table->count - table->tombstones;
+    int capacity = table->capacity > 0 ? table->capacity : 1;
+    printf("   %s: %d entries, %d tombstones in %d slots (load %d%%, tombstones %d%%)\n", name, entries,
+           table->tombstones, table->capacity, entries * 100 / capacity, table->tombstones * 100 / capacity);
+}
+
 void mark_table(Table *table) {
     for (int i = 0; i < table->capacity; ++i) {
         Entry *entry = &table->entries[i];
@@ -16,7 +16,11 @@ typedef struct {
 typedef struct {
     // the number of entries plus tombstones.
     int count;
+    int tombstones;
     int capacity;
+    // one byte per entry: empty, a tombstone, or the low 7 bits of a live key's hash. Probing reads them a
+    // group of 16 at a time and only touches the entries whose byte matches.
+    uint8_t *control;
     Entry *entries;
 } Table;
 
@@ -37,6 +41,10 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
 
 void table_remove_white(Table *table);
 
+void table_compact(Table *table);
+
+void print_table_stats(Table *table, const char *name);
+
 void mark_table(Table *table);
 
 #endif //CLOX_TABLE_H
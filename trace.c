@@ -0,0 +1,195 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#include "trace.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "object.h"
+
+// Loops are found at their back-edges: every OP_LOOP that run() takes counts towards the loop header it jumps to.
+// Once a header is hot, run() records the next iteration, one instruction at a time, and the steps it took get
+// compiled into a trace. Any loop iteration that strays from the recorded one leaves the trace at the branch where it
+// does, and run() carries on from there.
+
+typedef struct {
+    ObjFunction *function;
+    Trace *trace;
+    // the frame the loop runs in, by depth.
+    int frame_count;
+    // the frame slots in use at the loop header.
+    int depth;
+    TraceStep steps[TRACE_MAX_STEPS];
+    int step_count;
+} Recorder;
+
+static Recorder recorder;
+
+static Trace *find_trace(ObjFunction *function, int header) {
+    for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+        if (trace->header == header) {
+            return trace;
+        }
+    }
+
+    Trace *trace = ALLOCATE(Trace, 1);
+    trace->header = header;
+    trace->hotness = 0;
+    trace->aborts = 0;
+    trace->code = NULL;
+    trace->entry = NULL;
+    trace->memory = NULL;
+    trace->size = 0;
+    trace->next = function->traces;
+    function->traces = trace;
+    return trace;
+}
+
+/**
+ * Counts a back-edge to the loop header at frame's ip and runs the loop's trace, if it has one.
+ * Returns JIT_RECORD when run() should record the iteration starting now.
+ */
+JitStatus trace_loop(CallFrame *frame) {
+    ObjFunction *function = frame->closure->function;
+    Trace *trace = find_trace(function, (int) (frame->ip - function->chunk.code));
+    if (trace->code != NULL) {
+        return trace->code(frame, trace->entry);
+    }
+
+    if (trace->aborts == TRACE_MAX_ABORTS || ++trace->hotness < TRACE_THRESHOLD) {
+        return JIT_EXIT;
+    }
+
+    trace->hotness = 0;
+    recorder.function = function;
+    recorder.trace = trace;
+    recorder.frame_count = vm.frame_count;
+    recorder.depth = (int) (vm.stack_top - frame->slots);
+    recorder.step_count = 0;
+    return JIT_RECORD;
+}
+
+static bool abort_recording(const char *reason) {
+#ifdef DEBUG_PRINT_TRACES
+    printf("== abort trace at %d in %s: %s ==\n", recorder.trace->header,
+           recorder.function->name != NULL ? recorder.function->name->chars : "<script>", reason);
+#endif
+    recorder.trace->aborts++;
+    return false;
+}
+
+static bool finish_recording() {
+    if (!jit_compile_trace(recorder.function, recorder.trace, recorder.steps, recorder.step_count, recorder.depth)) {
+        recorder.trace->aborts = TRACE_MAX_ABORTS;
+        return abort_recording("can't compile");
+    }
+
+#ifdef DEBUG_PRINT_TRACES
+    printf("== trace at %d in %s: %d steps ==\n", recorder.trace->header,
+           recorder.function->name != NULL ? recorder.function->name->chars : "<script>", recorder.step_count);
+#endif
+    return false;
+}
+
+/**
+ * Records the instruction at frame's ip, before run() runs it.
+ * Returns false once the recording is over, because the iteration is complete or went somewhere a trace can't follow.
+ */
+bool trace_record(CallFrame *frame) {
+    if (vm.frame_count != recorder.frame_count) {
+        return abort_recording("left the frame");
+    }
+
+    Chunk *chunk = &recorder.function->chunk;
+    uint8_t *code = frame->ip;
+    int offset = (int) (code - chunk->code);
+    if (recorder.step_count > 0 && recorder.steps[recorder.step_count - 1].offset == offset) {
+        // a quickened instruction whose guard failed, which run() runs again in its generic form.
+        recorder.step_count--;
+    }
+    if (recorder.step_count == TRACE_MAX_STEPS) {
+        return abort_recording("too long");
+    }
+
+    TraceStep *step = &recorder.steps[recorder.step_count++];
+    step->offset = offset;
+    step->numbers = false;
+    switch (code[0]) {
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            step->numbers = IS_NUMBER(vm.stack_top[-1]) && IS_NUMBER(vm.stack_top[-2]);
+            break;
+        case OP_ADD_LOCAL_LOCAL:
+            step->numbers = IS_NUMBER(frame->slots[code[1]]) && IS_NUMBER(frame->slots[code[3]]);
+            break;
+        case OP_REG_ADD: {
+            Value a = code[2] & RK_CONSTANT ? chunk->constants.values[code[2] & ~RK_CONSTANT] : frame->slots[code[2]];
+            Value b = code[3] & RK_CONSTANT ? chunk->constants.values[code[3] & ~RK_CONSTANT] : frame->slots[code[3]];
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return abort_recording("register concatenation");
+            }
+            step->numbers = true;
+            break;
+        }
+        case OP_CALL:
+            // natives return before the next instruction, anything else runs in a frame of its own.
+            if (!IS_OBJ(vm.stack_top[-1 - code[1]]) || OBJ_TYPE(vm.stack_top[-1 - code[1]]) != OBJ_NATIVE) {
+                return abort_recording("call");
+            }
+            break;
+        case OP_LOOP:
+        case OP_LOOP_FAR: {
+            int target = jump_target(chunk, offset);
+            if (target == recorder.trace->header) {
+                return finish_recording();
+            }
+            // a for loop's body jumps back to its increment, but one that goes back into the iteration again loops
+            // inside it.
+            for (int i = 0; i < recorder.step_count; ++i) {
+                if (recorder.steps[i].offset == target) {
+                    return abort_recording("inner loop");
+                }
+            }
+            break;
+        }
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_CALL:
+        case OP_TAIL_INVOKE:
+            return abort_recording("call");
+        case OP_RETURN:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_INHERIT:
+        case OP_SEAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_WIDE:
+            return abort_recording("unsupported instruction");
+        default:
+            break;
+    }
+
+    return true;
+}
+
+void free_traces(ObjFunction *function) {
+    Trace *trace = function->traces;
+    while (trace != NULL) {
+        Trace *next = trace->next;
+        if (trace->memory != NULL) {
+            munmap(trace->memory, trace->size);
+        }
+        FREE(Trace, trace);
+        trace = next;
+    }
+    function->traces = NULL;
+}
+
+#endif
@@ -0,0 +1,54 @@
+//
+// Created by ocowchun on 2026/10/17.
+//
+
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "common.h"
+
+#ifdef JIT
+
+#include "jit.h"
+
+// back-edges to a loop header before an iteration of the loop gets recorded.
+#define TRACE_THRESHOLD 50
+// the most instructions a trace records.
+#define TRACE_MAX_STEPS 256
+// recordings of a loop that may fail before it is left to run() for good.
+#define TRACE_MAX_ABORTS 3
+
+// An instruction run() ran while a loop iteration was recorded.
+typedef struct {
+    int offset;
+    // whether the operands of an addition were numbers, the only type the code of a trace is specialised on.
+    // The others ops guard the types they expect like the baseline code does.
+    bool numbers;
+} TraceStep;
+
+// The native code of one iteration of a loop, run over and over until one of its guards fails.
+typedef struct Trace {
+    // the bytecode offset of the loop header, where the trace starts and ends.
+    int header;
+    // back-edges taken since the last recording.
+    int hotness;
+    int aborts;
+    // NULL until the loop is recorded and compiled.
+    NativeCode code;
+    void *entry;
+    void *memory;
+    size_t size;
+    struct Trace *next;
+} Trace;
+
+JitStatus trace_loop(CallFrame *frame);
+
+bool trace_record(CallFrame *frame);
+
+void free_traces(ObjFunction *function);
+
+bool jit_compile_trace(ObjFunction *function, Trace *trace, TraceStep *steps, int step_count, int depth);
+
+#endif
+
+#endif //CLOX_TRACE_H
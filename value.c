@@ -8,6 +8,8 @@
 #include "memory.h"
 #include "value.h"
 #include "object.h"
+#include "number.h"
+#include "output.h"
 
 
 void init_value_array(ValueArray *array) {
@@ -33,35 +35,55 @@ void free_value_array(ValueArray *array) {
     init_value_array(array);
 }
 
+static void print_number(double number) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    int length = format_number(number, buffer);
+    write_output(buffer, length);
+}
+
+static void print_bool(bool boolean) {
+    if (boolean) {
+        write_output("true", 4);
+    } else {
+        write_output("false", 5);
+    }
+}
+
+/**
+ * Prints val to the VM's output, see write_output().
+ */
 void print_value(Value val) {
 #ifdef NAN_BOXING
-    if (IS_NUMBER(val)) {
-        printf(AS_BOOL(val) ? "true" : "false");
+    if (IS_BOOL(val)) {
+        print_bool(AS_BOOL(val));
     } else if (IS_NIL(val)) {
-        printf("nil");
+        write_output("nil", 3);
     } else if (IS_NUMBER(val)) {
-        printf("%g", AS_NUMBER(val));
+        print_number(AS_NUMBER(val));
     } else if (IS_OBJ(val)) {
         print_object(val);
     }
 #else
     switch (val.type) {
         case VAL_BOOL: {
-            printf(AS_BOOL(val) ? "true" : "false");
+            print_bool(AS_BOOL(val));
             break;
         }
         case VAL_NIL: {
-            printf("nil");
+            write_output("nil", 3);
             break;
         }
         case VAL_NUMBER: {
-            printf("%g", AS_NUMBER(val));
+            print_number(AS_NUMBER(val));
             break;
         }
         case VAL_OBJ: {
             print_object(val);
             break;
         }
+        case VAL_UNDEFINED:
+            // unreachable, undefined globals are reported before their value is read.
+            break;
     }
 #endif
 }
@@ -71,7 +93,7 @@ bool values_equal(Value a, Value b) {
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    return a == b || (IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b)));
 #else
     if (a.type != b.type) {
         return false;
@@ -86,7 +108,8 @@ bool values_equal(Value a, Value b) {
             return AS_NUMBER(a) == AS_NUMBER(b);
         }
         case VAL_OBJ: {
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   (IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b)));
         }
         default:
             // unreachable
@@ -23,9 +23,11 @@ typedef uint64_t Value;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE 2 // 01
 #define TAG_TRUE 3 // 01
+#define TAG_UNDEFINED 4 // 100
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -44,6 +46,8 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+// the value of a global slot whose declaration hasn't run yet, never seen by Lox code.
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(number) num_to_value(number)
 
 
@@ -72,6 +76,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -88,6 +93,7 @@ typedef struct {
 #define IS_NIL(val) ((val).type == VAL_NIL)
 #define IS_NUMBER(val) ((val).type == VAL_NUMBER)
 #define IS_OBJ(val) ((val).type == VAL_OBJ)
+#define IS_UNDEFINED(val) ((val).type == VAL_UNDEFINED)
 
 #define AS_BOOL(val) ((val).as.boolean)
 #define AS_NUMBER(val) ((val).as.number)
@@ -97,6 +103,8 @@ typedef struct {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(val) ((Value){VAL_NUMBER, {.number = val}})
 #define OBJ_VAL(val) ((Value){VAL_OBJ, {.obj = (Obj*)val}})
+// the value of a global slot whose declaration hasn't run yet, never seen by Lox code.
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
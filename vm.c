@@ -3,8 +3,12 @@
 //
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "vm.h"
@@ -12,6 +16,9 @@
 #include "compiler.h"
 #include "object.h"
 #include "memory.h"
+#include "jit.h"
+#include "trace.h"
+#include "number.h"
 
 VirtualMachine vm;
 
@@ -19,13 +26,106 @@ static Value clock_native(int arg_count, Value *arg) {
     return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
 }
 
+/**
+ * Returns its argument as a string, written as print would write it. A string comes back as it is.
+ */
+static Value str_native(int arg_count, Value *arg) {
+    Value value = arg[0];
+    if (IS_STRING(value)) {
+        return value;
+    }
+    if (IS_NUMBER(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        int length = format_number(AS_NUMBER(value), buffer);
+        ObjString *string = new_string(length);
+        memcpy(string->chars, buffer, length);
+        return OBJ_VAL(string);
+    }
+
+    Capture capture;
+    begin_capture(&capture);
+    print_value(value);
+    end_capture();
+    ObjString *string = new_string(capture.count);
+    memcpy(string->chars, capture.chars, capture.count);
+    free(capture.chars);
+    return OBJ_VAL(string);
+}
+
+static size_t page_size;
+
+/**
+ * Rounds capacity up to the values that fill whole pages, so that the stack ends right at its guard page.
+ */
+static int stack_pages(int capacity) {
+    int per_page = (int) (page_size / sizeof(Value));
+    return (capacity + per_page - 1) / per_page * per_page;
+}
+
+/**
+ * Maps a stack of capacity values, followed by a guard page that faults on any access. A push past the end of the
+ * stack lands there, see on_stack_fault().
+ */
+static Value *map_stack(int capacity) {
+    size_t size = sizeof(Value) * capacity;
+    void *memory = mmap(NULL, size + page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED || mprotect((char *) memory + size, page_size, PROT_NONE) != 0) {
+        exit(1);
+    }
+
+    return (Value *) memory;
+}
+
+static void unmap_stack(Value *stack, int capacity) {
+    munmap(stack, sizeof(Value) * capacity + page_size);
+}
+
+// what SIGSEGV did before guard_stack(), main.c's backtrace for one.
+static struct sigaction previous_fault_action;
+
+/**
+ * Turns a fault on the guard page of the stack into a jump to vm.stack_overflow, which reports it as a runtime error.
+ * Any other fault is a bug, which goes back to the action SIGSEGV had before guard_stack() once the faulting
+ * instruction runs again.
+ */
+static void on_stack_fault(int signal, siginfo_t *info, void *context) {
+    char *guard = (char *) (vm.stack + vm.stack_capacity);
+    char *address = (char *) info->si_addr;
+    if (vm.stack_overflow != NULL && address >= guard && address < guard + page_size) {
+        siglongjmp(*vm.stack_overflow, 1);
+    }
+
+    sigaction(signal, &previous_fault_action, NULL);
+}
+
+static void guard_stack() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = on_stack_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    struct sigaction previous;
+    sigaction(SIGSEGV, &action, &previous);
+    // a VM initialized again finds its own handler there, which it must not go back to.
+    if (previous.sa_sigaction != on_stack_fault) {
+        previous_fault_action = previous;
+    }
+}
+
 static void reset_stack() {
     vm.stack_top = vm.stack;
     vm.frame_count = 0;
+    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        vm.open_upvalue_slots[upvalue->location - vm.stack] = NULL;
+    }
     vm.open_upvalues = NULL;
 }
 
-static void runtime_error(const char *format, ...) {
+void runtime_error(const char *format, ...) {
+    // what the script printed comes before the error.
+    flush_output();
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -47,18 +147,34 @@ static void runtime_error(const char *format, ...) {
     reset_stack();
 }
 
-static void define_native(const char *name, NativeFn function) {
+static void define_native(const char *name, NativeFn function, int arity) {
     //  to ensure the collector knows we’re not done with the name and ObjFunction
     //  so that it doesn’t free them out from under us.
     push(OBJ_VAL(copy_string(name, (int) strlen(name))));
-    push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(new_native(function, arity)));
+    int slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.global_values.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 
 void init_virtual_machine() {
+    // the stack and the frames aren't objects, so like the gray stack they live outside of the GC's accounting.
+    vm.frame_capacity = FRAMES_INITIAL;
+    vm.frames = (CallFrame *) malloc(sizeof(CallFrame) * vm.frame_capacity);
+    if (vm.frames == NULL) {
+        exit(1);
+    }
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+    vm.stack_capacity = stack_pages(STACK_INITIAL);
+    vm.stack = map_stack(vm.stack_capacity);
+    vm.open_upvalue_slots = (ObjUpvalue **) calloc(vm.stack_capacity, sizeof(ObjUpvalue *));
+    if (vm.open_upvalue_slots == NULL) {
+        exit(1);
+    }
+    vm.stack_overflow = NULL;
+    guard_stack();
     reset_stack();
     vm.objects = NULL;
 
@@ -69,7 +185,9 @@ void init_virtual_machine() {
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
 
-    init_table(&vm.globals);
+    init_table(&vm.global_slots);
+    init_value_array(&vm.global_names);
+    init_value_array(&vm.global_values);
     init_table(&vm.strings);
 
     // copying a string allocates memory, which can trigger a GC.
@@ -78,18 +196,83 @@ void init_virtual_machine() {
     vm.init_string = NULL;
     vm.init_string = copy_string("init", 4);
 
-    define_native("clock", clock_native);
+    init_output(&vm.output);
+    // for an exit() past free_virtual_machine(), like the one on running out of memory.
+    atexit(flush_output);
+
+    define_native("clock", clock_native, 0);
+    define_native("str", str_native, 1);
 }
 
 void free_virtual_machine() {
-    free_table(&vm.globals);
+    free_table(&vm.global_slots);
+    free_value_array(&vm.global_names);
+    free_value_array(&vm.global_values);
     free_table(&vm.strings);
     vm.init_string = NULL;
     free_objects();
+    free(vm.frames);
+    vm.frames = NULL;
+    vm.frame_capacity = 0;
+    unmap_stack(vm.stack, vm.stack_capacity);
+    vm.stack = NULL;
+    free(vm.open_upvalue_slots);
+    vm.open_upvalue_slots = NULL;
+    vm.stack_capacity = 0;
+    free_output(&vm.output);
+}
+
+/**
+ * Moves the stack to a block with room for count more values above the top, and whatever points into the stack
+ * along with it: the top, the slots of every frame and the open upvalues.
+ */
+static void grow_stack(int count) {
+    int needed = (int) (vm.stack_top - vm.stack) + count;
+    int capacity = vm.stack_capacity;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    Value *stack = map_stack(capacity);
+    memcpy(stack, vm.stack, sizeof(Value) * (vm.stack_top - vm.stack));
+    vm.stack_top = stack + (vm.stack_top - vm.stack);
+    for (int i = 0; i < vm.frame_count; ++i) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+    unmap_stack(vm.stack, vm.stack_capacity);
+    vm.stack = stack;
+
+    ObjUpvalue **slots = (ObjUpvalue **) realloc(vm.open_upvalue_slots, sizeof(ObjUpvalue *) * capacity);
+    if (slots == NULL) {
+        exit(1);
+    }
+    memset(slots + vm.stack_capacity, 0, sizeof(ObjUpvalue *) * (capacity - vm.stack_capacity));
+    vm.open_upvalue_slots = slots;
+    vm.stack_capacity = capacity;
+}
+
+void reserve_stack(int count) {
+    if (vm.stack_top + count > vm.stack + vm.stack_capacity) {
+        grow_stack(count);
+    }
+}
+
+static void grow_frames() {
+    int capacity = vm.frame_capacity * 2;
+    CallFrame *frames = (CallFrame *) realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (frames == NULL) {
+        exit(1);
+    }
+
+    vm.frames = frames;
+    vm.frame_capacity = capacity;
 }
 
 void push(const Value val) {
-    // TODO: check no overflow
+    // no need to check for room: call() made some for the frame, and the guard page catches a push past it.
     *vm.stack_top = val;
     vm.stack_top++;
 }
@@ -109,11 +292,28 @@ static bool call(ObjClosure *closure, int arg_count) {
         return false;
     }
 
-    if (vm.frame_count == FRAME_MAX) {
+    // check the most the frame holds at once, as the compiler measured it, fits in what is left of the stack.
+    // This is the only check, pushes in the frame go unchecked.
+    int slots = (int) (vm.stack_top - vm.stack) - arg_count - 1;
+    int needed = slots + closure->function->stack_size + FRAME_HEADROOM;
+    if (vm.frame_count == FRAME_MAX || needed > STACK_MAX) {
         runtime_error("Stack overflow.");
         return false;
     }
 
+    if (needed > vm.stack_capacity) {
+        grow_stack(needed - (int) (vm.stack_top - vm.stack));
+    }
+    if (vm.frame_count == vm.frame_capacity) {
+        grow_frames();
+    }
+
+#ifdef JIT
+    if (++closure->function->call_count == JIT_THRESHOLD) {
+        jit_compile(closure->function);
+    }
+#endif
+
     CallFrame *frame = &vm.frames[vm.frame_count++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -136,9 +336,8 @@ static bool call_value(const Value callee, const int arg_count) {
                 ObjClass *klass = AS_CLASS(callee);
                 vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(klass));
 
-                Value initializer;
-                if (table_get(&klass->methods, vm.init_string, &initializer)) {
-                    return call(AS_CLOSURE(initializer), arg_count);
+                if (klass->initializer != NULL) {
+                    return call(klass->initializer, arg_count);
                 } else if (arg_count != 0) {
                     runtime_error("Expected 0 arguments but got %d.", arg_count);
                     return false;
@@ -149,8 +348,12 @@ static bool call_value(const Value callee, const int arg_count) {
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), arg_count);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(arg_count, vm.stack_top - arg_count);
+                ObjNative *native = (ObjNative *) AS_OBJ(callee);
+                if (arg_count != native->arity) {
+                    runtime_error("Expected %d arguments but got %d.", native->arity, arg_count);
+                    return false;
+                }
+                Value result = native->function(arg_count, vm.stack_top - arg_count);
                 vm.stack_top -= arg_count + 1;
                 push(result);
                 return true;
@@ -165,17 +368,115 @@ static bool call_value(const Value callee, const int arg_count) {
     return false;
 }
 
-static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count) {
-    Value method;
-    if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
+static void close_upvalues(Value *last) {
+    // moving the local from the stack to the heap.
+
+    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
+        ObjUpvalue *upvalue = vm.open_upvalues;
+        vm.open_upvalue_slots[upvalue->location - vm.stack] = NULL;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm.open_upvalues = upvalue->next;
+    }
+}
+
+/**
+ * Calls closure in the frame on top, in place of the function running there, which returns whatever closure does.
+ */
+static bool tail_call(ObjClosure *closure, int arg_count) {
+    if (arg_count != closure->function->arity) {
+        // reports the error from the caller, like any other call.
+        return call(closure, arg_count);
+    }
+
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    close_upvalues(frame->slots);
+    Value *callee = vm.stack_top - arg_count - 1;
+    memmove(frame->slots, callee, sizeof(Value) * (arg_count + 1));
+    vm.stack_top = frame->slots + arg_count + 1;
+    vm.frame_count--;
+    return call(closure, arg_count);
+}
+
+/**
+ * Calls callee as a tail call if it runs in a frame of its own. Natives and classes are called as usual, and the
+ * OP_RETURN after the call returns what they leave.
+ */
+static bool tail_call_value(const Value callee, const int arg_count) {
+    if (IS_CLOSURE(callee)) {
+        return tail_call(AS_CLOSURE(callee), arg_count);
+    }
+
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod *bound_method = AS_BOUND_METHOD(callee);
+        vm.stack_top[-arg_count - 1] = bound_method->receiver;
+        return tail_call(bound_method->method, arg_count);
+    }
+
+    return call_value(callee, arg_count);
+}
+
+static inline ObjClosure *cached_method(InlineCache *cache, ObjClass *klass) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; ++i) {
+        InlineCacheEntry *entry = &cache->entries[i];
+        if (entry->klass == klass && entry->version == klass->version) {
+            return entry->method;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Puts method first in cache, reusing the way holding a stale entry for klass, or else an empty one or the last one.
+ */
+static void cache_method(InlineCache *cache, ObjClass *klass, ObjClosure *method) {
+    int way = INLINE_CACHE_WAYS - 1;
+    for (int i = 0; i < INLINE_CACHE_WAYS; ++i) {
+        if (cache->entries[i].klass == klass || cache->entries[i].klass == NULL) {
+            way = i;
+            break;
+        }
+    }
+
+    memmove(&cache->entries[1], &cache->entries[0], way * sizeof(InlineCacheEntry));
+    cache->entries[0].klass = klass;
+    cache->entries[0].version = klass->version;
+    cache->entries[0].method = method;
+}
+
+/**
+ * Returns the method name of superclass, looked up through the call site's cache, or NULL if there is none.
+ */
+static inline ObjClosure *super_method(ObjClass *superclass, ObjString *name, InlineCache *cache) {
+    ObjClosure *method = cached_method(cache, superclass);
+    if (method == NULL) {
+        Value value;
+        if (!table_get(&superclass->methods, name, &value)) {
+            runtime_error("Undefined property '%s'.", name->chars);
+            return NULL;
+        }
+
+        method = AS_CLOSURE(value);
+        cache_method(cache, superclass, method);
+    }
+
+    return method;
+}
+
+static bool invoke_from_class(ObjClass *klass, ObjString *name, int arg_count, InlineCache *cache) {
+    ObjClosure *method = super_method(klass, name, cache);
+    if (method == NULL) {
         return false;
     }
 
-    return call(AS_CLOSURE(method), arg_count);
+    return call(method, arg_count);
 }
 
-static bool invoke(ObjString *name, int arg_count) {
+/**
+ * Calls method name on the receiver under the arguments, as a tail call if tail is set.
+ */
+static inline bool invoke(ObjString *name, int arg_count, InlineCache *cache, bool tail) {
     Value receiver = peek(arg_count);
     if (!IS_INSTANCE(receiver)) {
         runtime_error("Only instances have methods.");
@@ -183,13 +484,28 @@ static bool invoke(ObjString *name, int arg_count) {
     }
 
     ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjClass *klass = instance->klass;
+    // a class only gets cached while no field shadows its methods, so a hit doesn't need to look at the fields.
+    ObjClosure *method = cached_method(cache, klass);
+    if (method != NULL) {
+        return tail ? tail_call(method, arg_count) : call(method, arg_count);
+    }
+
     Value value;
-    if (table_get(&instance->fields, name, &value)) {
+    if (instance_get_field(instance, name, &value)) {
         vm.stack_top[-arg_count - 1] = value;
-        return call_value(value, arg_count);
+        return tail ? tail_call_value(value, arg_count) : call_value(value, arg_count);
+    }
+
+    if (!table_get(&klass->methods, name, &value)) {
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
     }
 
-    return invoke_from_class(instance->klass, name, arg_count);
+    if (!klass->shadowed) {
+        cache_method(cache, klass, AS_CLOSURE(value));
+    }
+    return tail ? tail_call(AS_CLOSURE(value), arg_count) : call(AS_CLOSURE(value), arg_count);
 }
 
 static bool bind_method(ObjClass *klass, ObjString *method_name) {
@@ -208,18 +524,154 @@ static bool bind_method(ObjClass *klass, ObjString *method_name) {
     return true;
 }
 
+static bool bind_super_method(ObjClass *superclass, ObjString *name, InlineCache *cache) {
+    ObjClosure *method = super_method(superclass, name, cache);
+    if (method == NULL) {
+        return false;
+    }
+
+    ObjBoundMethod *bound_method = new_bound_method(peek(0), method);
+
+    // pop instance
+    pop();
+    push(OBJ_VAL(bound_method));
+    return true;
+}
+
+/**
+ * Replaces the instance on top of the stack with its property name, a field or a bound method.
+ */
+static bool get_property(ObjString *name) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtime_error("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    Value value;
+    if (instance_get_field(instance, name, &value)) {
+        pop(); // Instance.
+        push(value);
+        return true;
+    }
+
+    return bind_method(instance->klass, name);
+}
+
+/**
+ * Looks up field name of receiver in its shape, remembering the shape and the field's slot in cache.
+ * Returns false if receiver is not an instance holding the field in a shape slot.
+ */
+static bool cache_property(PropertyCache *cache, Value receiver, ObjString *name, Value *value) {
+    if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape == NULL) {
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjShape *shape = instance->shape;
+    for (int slot = 0; slot < shape->field_count; ++slot) {
+        if (shape->keys[slot] == name) {
+            cache->shape = shape;
+            cache->slot = slot;
+            *value = instance->fields[slot];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline bool cached_property(PropertyCache *cache, Value receiver, Value *value) {
+    if (!IS_INSTANCE(receiver)) {
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    if (instance->shape != cache->shape || instance->shape == NULL) {
+        return false;
+    }
+
+    *value = instance->fields[cache->slot];
+    return true;
+}
+
+/**
+ * Replaces the instance and the value on top of the stack with the value, after storing it in field name.
+ */
+static inline bool set_property(ObjString *name) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtime_error("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    instance_set_field(instance, name, peek(0));
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+/**
+ * Returns the slot of the global variable name, adding an undefined slot the first time the name is seen.
+ */
+int global_slot(ObjString *name) {
+    Value slot;
+    if (table_get(&vm.global_slots, name, &slot)) {
+        return (int) AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    write_value_array(&vm.global_names, OBJ_VAL(name));
+    write_value_array(&vm.global_values, UNDEFINED_VAL);
+    table_set(&vm.global_slots, name, NUMBER_VAL(vm.global_values.count - 1));
+    pop();
+    return vm.global_values.count - 1;
+}
+
+static void undefined_global(int slot) {
+    runtime_error("Undefined variable '%s'.", AS_CSTRING(vm.global_names.values[slot]));
+}
+
+static inline bool get_global(int slot) {
+    Value value = vm.global_values.values[slot];
+    if (IS_UNDEFINED(value)) {
+        undefined_global(slot);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+static inline void define_global(int slot) {
+    vm.global_values.values[slot] = pop();
+}
+
+static inline bool set_global(int slot) {
+    if (IS_UNDEFINED(vm.global_values.values[slot])) {
+        undefined_global(slot);
+        return false;
+    }
+    vm.global_values.values[slot] = peek(0);
+    return true;
+}
+
 static ObjUpvalue *capture_upvalue(Value *local) {
+    int slot = (int) (local - vm.stack);
+    if (vm.open_upvalue_slots[slot] != NULL) {
+        return vm.open_upvalue_slots[slot];
+    }
+
+    // only a new upvalue walks the list, to its place in the order, which is usually on top.
     ObjUpvalue *pre_upvalue = NULL;
     ObjUpvalue *upvalue = vm.open_upvalues;
     while (upvalue != NULL && upvalue->location > local) {
         pre_upvalue = upvalue;
         upvalue = upvalue->next;
     }
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
 
     ObjUpvalue *created_upvalue = new_upvalue(local);
+    vm.open_upvalue_slots[slot] = created_upvalue;
     created_upvalue->next = upvalue;
     if (pre_upvalue == NULL) {
         vm.open_upvalues = created_upvalue;
@@ -229,24 +681,90 @@ static ObjUpvalue *capture_upvalue(Value *local) {
     return created_upvalue;
 }
 
-static void close_upvalues(Value *last) {
-    // moving the local from the stack to the heap.
-
-    while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.open_upvalues;
-        upvalue->closed = *upvalue->location;
-        upvalue->location = &upvalue->closed;
-        vm.open_upvalues = upvalue->next;
-    }
-}
-
 static void define_method(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
     table_set(&klass->methods, name, method);
+    klass->version++;
     pop(); // pop closure
 }
 
+static bool inherit() {
+    Value super_class = peek(1);
+    if (!IS_CLASS(super_class)) {
+        runtime_error("Superclass must be a class.");
+        return false;
+    }
+
+    ObjClass *sub_class = AS_CLASS(peek(0));
+    sub_class->superclass = AS_CLASS(super_class);
+    table_add_all(&AS_CLASS(super_class)->methods, &sub_class->methods);
+    sub_class->version++;
+
+    // Subclass
+    pop();
+    return true;
+}
+
+/**
+ * Fills the caches of the super calls in method, whose super is always superclass.
+ */
+static void prime_super_calls(ObjClosure *method, ObjClass *superclass) {
+    Chunk *chunk = &method->function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        uint8_t *code = chunk->code + offset;
+        int name;
+        uint8_t *cache;
+        if (code[0] == OP_GET_SUPER) {
+            name = code[1];
+            cache = code + 2;
+        } else if (code[0] == OP_SUPER_INVOKE) {
+            name = code[1];
+            cache = code + 3;
+        } else if (code[0] == OP_WIDE && code[1] == OP_GET_SUPER) {
+            name = read_wide_operand(code + 2);
+            cache = code + 5;
+        } else if (code[0] == OP_WIDE && code[1] == OP_SUPER_INVOKE) {
+            name = read_wide_operand(code + 2);
+            cache = code + 6;
+        } else {
+            continue;
+        }
+
+        Value value;
+        if (table_get(&superclass->methods, AS_STRING(chunk->constants.values[name]), &value)) {
+            cache_method(&chunk->inline_caches[(cache[0] << 8) | cache[1]], superclass, AS_CLOSURE(value));
+        }
+    }
+}
+
+/**
+ * Resolves what the class looks up on every construction and super call, once its declaration has added all of its
+ * methods.
+ */
+static void seal_class(ObjClass *klass) {
+    Value initializer;
+    if (table_get(&klass->methods, vm.init_string, &initializer)) {
+        klass->initializer = AS_CLOSURE(initializer);
+    }
+
+    ObjClass *superclass = klass->superclass;
+    if (superclass == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < klass->methods.capacity; ++i) {
+        Entry *entry = &klass->methods.entries[i];
+        Value inherited;
+        if (entry->key == NULL ||
+            (table_get(&superclass->methods, entry->key, &inherited) && values_equal(inherited, entry->value))) {
+            continue;
+        }
+
+        prime_super_calls(AS_CLOSURE(entry->value), superclass);
+    }
+}
+
 static bool is_falsey(Value val) {
     return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
 }
@@ -256,336 +774,1153 @@ static void concatenate() {
     ObjString *a = AS_STRING(peek(1));
 
     int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-
-    ObjString *result = take_string(chars, length);
+    ObjString *result;
+    if (length >= ROPE_MIN_LENGTH) {
+        // building a string piece by piece doesn't copy what it has so far each time.
+        result = new_rope(a, b);
+    } else {
+        // not hashed or interned, no table is keyed by a string made at runtime.
+        result = new_string(length);
+        memcpy(result->chars, a->chars, a->length);
+        memcpy(result->chars + a->length, b->chars, b->length);
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+/**
+ * Reads the captures following an OP_CLOSURE at frame's ip into closure,
+ * each an is_local flag and a slot or upvalue index of 1 byte, or 3 bytes when wide.
+ */
+static void capture_upvalues(CallFrame *frame, ObjClosure *closure, bool wide) {
+    closure->frame_base = (int) (frame->slots - vm.stack);
+    for (int i = 0; i < closure->upvalue_count; ++i) {
+        uint8_t capture = *frame->ip++;
+        int index;
+        if (wide) {
+            index = read_wide_operand(frame->ip);
+            frame->ip += 3;
+        } else {
+            index = *frame->ip++;
+        }
 
-#define READ_BYTE() (*frame->ip++)
+        if (capture == CAPTURE_LOCAL) {
+            closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        } else if (capture == CAPTURE_UPVALUE) {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
 
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+/**
+ * Evaluates the comparison of a register compare-and-branch.
+ */
+static bool register_condition(uint8_t instruction, Value lhs, Value rhs, bool *holds) {
+    if (instruction == OP_REG_JUMP_UNLESS_EQUAL || instruction == OP_REG_JUMP_UNLESS_NOT_EQUAL) {
+        *holds = values_equal(lhs, rhs) == (instruction == OP_REG_JUMP_UNLESS_EQUAL);
+        return true;
+    }
 
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    if (!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) {
+        runtime_error("Operands must be numbers.");
+        return false;
+    }
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+    double a = AS_NUMBER(lhs);
+    double b = AS_NUMBER(rhs);
+    switch (instruction) {
+        case OP_REG_JUMP_UNLESS_GREATER:
+            *holds = a > b;
+            break;
+        case OP_REG_JUMP_UNLESS_GREATER_EQUAL:
+            *holds = !(a < b);
+            break;
+        case OP_REG_JUMP_UNLESS_LESS:
+            *holds = a < b;
+            break;
+        default:
+            *holds = !(a > b);
+            break;
+    }
+    return true;
+}
 
-#define BINARY_OP(value_type, op) \
-    do {              \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtime_error("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR;               \
-        }\
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
-    } while (false)
+static inline Value register_value(CallFrame *frame, uint8_t operand) {
+    if (operand & RK_CONSTANT) {
+        return frame->closure->function->chunk.constants.values[operand & ~RK_CONSTANT];
+    }
 
+    return frame->slots[operand];
+}
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->closure->function->chunk,
-                                (int) (frame->ip - frame->closure->function->chunk.code));
-#endif
-        uint8_t instruction;
+static JitStatus call_status(bool success, int frame_count) {
+    if (!success) {
+        return JIT_ERROR;
+    }
 
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: {
-                push(NIL_VAL);
-                break;
-            }
-            case OP_TRUE: {
-                push(BOOL_VAL(true));
-                break;
-            }
-            case OP_FALSE: {
-                push(BOOL_VAL(false));
-                break;
-            }
-            case OP_POP: {
-                pop();
-                break;
-            }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                table_set(&vm.globals, name, peek(0));
-                // we don’t pop the value until after we add it to the hash table.
-                // That ensures the VM can still find the value if a garbage collection is triggered right
-                // in the middle of adding it to the hash table. That’s a distinct possibility since the hash table
-                // requires dynamic allocation when it resizes.
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+    return vm.frame_count == frame_count ? JIT_CONTINUE : JIT_FRAME;
+}
+
+bool jit_add() {
+    // the native code adds numbers itself.
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+        return true;
+    }
+
+    runtime_error("Operands must be two numbers or two strings.");
+    return false;
+}
+
+JitStatus jit_call(int arg_count) {
+    int frame_count = vm.frame_count;
+    return call_status(call_value(peek(arg_count), arg_count), frame_count);
+}
+
+JitStatus jit_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    int frame_count = vm.frame_count;
+    return call_status(invoke(name, arg_count, cache, false), frame_count);
+}
+
+/**
+ * Returns the status of a tail call made at ip, which calls for the frame on top again once it has a new callee in
+ * it, or one more frame.
+ */
+static JitStatus tail_call_status(bool success, uint8_t *ip, int frame_count) {
+    if (!success) {
+        return JIT_ERROR;
+    }
+
+    return vm.frame_count == frame_count && vm.frames[frame_count - 1].ip == ip ? JIT_CONTINUE : JIT_FRAME;
+}
+
+JitStatus jit_tail_call(int arg_count) {
+    int frame_count = vm.frame_count;
+    uint8_t *ip = vm.frames[frame_count - 1].ip;
+    return tail_call_status(tail_call_value(peek(arg_count), arg_count), ip, frame_count);
+}
+
+JitStatus jit_tail_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    int frame_count = vm.frame_count;
+    uint8_t *ip = vm.frames[frame_count - 1].ip;
+    return tail_call_status(invoke(name, arg_count, cache, true), ip, frame_count);
+}
+
+JitStatus jit_super_invoke(ObjString *name, int arg_count, InlineCache *cache) {
+    int frame_count = vm.frame_count;
+    return call_status(invoke_from_class(AS_CLASS(pop()), name, arg_count, cache), frame_count);
+}
+
+JitStatus jit_return() {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    Value result = pop();
+    close_upvalues(frame->slots);
+    vm.frame_count--;
+
+    if (vm.frame_count == 0) {
+        pop();
+        return JIT_DONE;
+    }
+
+    vm.stack_top = frame->slots;
+    push(result);
+    return JIT_FRAME;
+}
+
+bool jit_get_property(ObjString *name, PropertyCache *cache) {
+    Value value;
+    if (cache != NULL && cache_property(cache, peek(0), name, &value)) {
+        vm.stack_top[-1] = value;
+        return true;
+    }
+
+    return get_property(name);
+}
+
+bool jit_set_property(ObjString *name) {
+    return set_property(name);
+}
+
+bool jit_get_super(ObjString *name, InlineCache *cache) {
+    return bind_super_method(AS_CLASS(pop()), name, cache);
+}
+
+void jit_close_upvalue() {
+    close_upvalues(vm.stack_top - 1);
+    pop();
+}
+
+void jit_print() {
+    print_value(pop());
+    write_output("\n", 1);
+}
+
+bool jit_get_global(int slot) {
+    return get_global(slot);
+}
+
+bool jit_set_global(int slot) {
+    return set_global(slot);
+}
+
+void jit_define_global(int slot) {
+    define_global(slot);
+}
+
+void jit_closure(ObjFunction *function, bool wide) {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+    ObjClosure *closure = new_closure(function);
+    push(OBJ_VAL(closure));
+    capture_upvalues(frame, closure, wide);
+}
+
+void jit_class(ObjString *name) {
+    push(OBJ_VAL(new_class(name)));
+}
+
+void jit_method(ObjString *name) {
+    define_method(name);
+}
+
+bool jit_inherit() {
+    return inherit();
+}
+
+void jit_seal() {
+    seal_class(AS_CLASS(peek(0)));
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(CallFrame *frame) {
+    printf("          ");
+    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(&frame->closure->function->chunk,
+                            (int) (frame->ip - frame->closure->function->chunk.code));
+}
+
+#define TRACE_EXECUTION() trace_execution(frame)
+#else
+#define TRACE_EXECUTION() ((void) 0)
+#endif
+
+static InterpretResult run() {
+    CallFrame *frame = &vm.frames[vm.frame_count - 1];
+
+#define READ_BYTE() (*frame->ip++)
+
+#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+
+#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+
+#define READ_INLINE_CACHE() (&frame->closure->function->chunk.inline_caches[READ_SHORT()])
+
+#define READ_FAR_JUMP() (&frame->closure->function->chunk.far_jumps[READ_SHORT()])
+
+#define READ_PROPERTY_CACHE() (&frame->closure->function->chunk.property_caches[READ_SHORT()])
+
+// the constant named by the 3-byte operand of an OP_WIDE instruction.
+#define WIDE_CONSTANT() (frame->closure->function->chunk.constants.values[operand])
+
+#define WIDE_STRING() AS_STRING(WIDE_CONSTANT())
+
+#define BINARY_OP(value_type, op) \
+    do {              \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+            runtime_error("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR;               \
+        }\
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(value_type(a op b)); \
+    } while (false)
+
+#define NEGATED_BOOL_VAL(b) BOOL_VAL(!(b))
+
+// applies expression, over the number a on top of the stack and the immediate b, in place.
+#define IMMEDIATE_OP(value_type, expression, b_value, error_message) \
+    do { \
+        double b = (b_value); \
+        if (!IS_NUMBER(peek(0))) { \
+            runtime_error(error_message); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double a = AS_NUMBER(peek(0)); \
+        vm.stack_top[-1] = value_type(expression); \
+    } while (false)
+
+#define READ_SMALL() ((double) READ_BYTE())
+
+#define READ_NUMBER_CONSTANT() AS_NUMBER(READ_CONSTANT())
+
+#define READ_REGISTER() register_value(frame, READ_BYTE())
+
+// superinstructions read the operands of the sequence they replaced at its original offsets, relative to ip.
+#define FUSED_BYTE(offset) (frame->ip[offset])
+
+#define FUSED_SHORT(offset) ((uint16_t) ((frame->ip[offset] << 8) | frame->ip[(offset) + 1]))
+
+#define FUSED_LESS_JUMP(b_value, length) \
+    do { \
+        Value a = frame->slots[FUSED_BYTE(0)]; \
+        Value b = (b_value); \
+        uint16_t offset = FUSED_SHORT((length) - 3); \
+        frame->ip += (length) - 1; \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtime_error("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        bool less = AS_NUMBER(a) < AS_NUMBER(b); \
+        push(BOOL_VAL(less)); \
+        if (!less) { \
+            frame->ip += offset; \
+        } \
+    } while (false)
+
+#define REGISTER_BINARY_OP(op) \
+    do { \
+        uint8_t dst = READ_BYTE(); \
+        Value a = READ_REGISTER(); \
+        Value b = READ_REGISTER(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            runtime_error("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        frame->slots[dst] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+    } while (false)
+
+// jumps forward unless test holds for the two register operands, as numbers a and b.
+#define REGISTER_COMPARE_JUMP(test) \
+    do { \
+        Value lhs = READ_REGISTER(); \
+        Value rhs = READ_REGISTER(); \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) { \
+            runtime_error("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double a = AS_NUMBER(lhs); \
+        double b = AS_NUMBER(rhs); \
+        if (!(test)) { \
+            frame->ip += offset; \
+        } \
+    } while (false)
+
+#ifdef JIT
+// hands the frame on top to its native code, if it has been compiled, until that needs run() again.
+#define ENTER_JIT() \
+    do { \
+        if (frame->closure->function->jit != NULL) { \
+            JitStatus status = jit_run(); \
+            if (status == JIT_ERROR) { \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            if (status == JIT_DONE) { \
+                return INTERPRET_OK; \
+            } \
+            frame = &vm.frames[vm.frame_count - 1]; \
+        } \
+    } while (false)
+
+// counts the back-edge to the loop header at frame's ip, and runs the loop's trace once it has one.
+#define BACK_EDGE() \
+    do { \
+        if (frame->closure->function->jit == NULL && jit_enabled && !RECORDING()) { \
+            JitStatus status = trace_loop(frame); \
+            if (status == JIT_ERROR) { \
+                return INTERPRET_RUNTIME_ERROR; \
+            } \
+            if (status == JIT_RECORD) { \
+                START_RECORDING(); \
+            } \
+            frame = &vm.frames[vm.frame_count - 1]; \
+        } \
+        ENTER_JIT(); \
+    } while (false)
+#else
+#define ENTER_JIT() ((void) 0)
+#define BACK_EDGE() ((void) 0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // Threaded dispatch: every handler ends with its own indirect jump through this table,
+    // so the branch predictor sees one dispatch site per opcode instead of a single shared one.
+    static void *dispatch_table[] = {
+        [OP_CONSTANT] = &&TARGET_OP_CONSTANT,
+        [OP_NIL] = &&TARGET_OP_NIL,
+        [OP_TRUE] = &&TARGET_OP_TRUE,
+        [OP_FALSE] = &&TARGET_OP_FALSE,
+        [OP_EQUAL] = &&TARGET_OP_EQUAL,
+        [OP_GREATER] = &&TARGET_OP_GREATER,
+        [OP_LESS] = &&TARGET_OP_LESS,
+        [OP_NOT_EQUAL] = &&TARGET_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&TARGET_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&TARGET_OP_LESS_EQUAL,
+        [OP_NEGATE] = &&TARGET_OP_NEGATE,
+        [OP_ADD] = &&TARGET_OP_ADD,
+        [OP_SUBTRACT] = &&TARGET_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&TARGET_OP_MULTIPLY,
+        [OP_DIVIDE] = &&TARGET_OP_DIVIDE,
+        [OP_NOT] = &&TARGET_OP_NOT,
+        [OP_RETURN] = &&TARGET_OP_RETURN,
+        [OP_PRINT] = &&TARGET_OP_PRINT,
+        [OP_POP] = &&TARGET_OP_POP,
+        [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&TARGET_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&TARGET_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&TARGET_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&TARGET_OP_SET_LOCAL,
+        [OP_GET_UPVALUE] = &&TARGET_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&TARGET_OP_SET_UPVALUE,
+        [OP_GET_ENCLOSING] = &&TARGET_OP_GET_ENCLOSING,
+        [OP_SET_ENCLOSING] = &&TARGET_OP_SET_ENCLOSING,
+        [OP_SET_PROPERTY] = &&TARGET_OP_SET_PROPERTY,
+        [OP_GET_PROPERTY] = &&TARGET_OP_GET_PROPERTY,
+        [OP_GET_SUPER] = &&TARGET_OP_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&TARGET_OP_SUPER_INVOKE,
+        [OP_JUMP] = &&TARGET_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&TARGET_OP_LOOP,
+        [OP_CALL] = &&TARGET_OP_CALL,
+        [OP_CLOSURE] = &&TARGET_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+        [OP_CLASS] = &&TARGET_OP_CLASS,
+        [OP_METHOD] = &&TARGET_OP_METHOD,
+        [OP_INVOKE] = &&TARGET_OP_INVOKE,
+        [OP_TAIL_CALL] = &&TARGET_OP_TAIL_CALL,
+        [OP_TAIL_INVOKE] = &&TARGET_OP_TAIL_INVOKE,
+        [OP_INHERIT] = &&TARGET_OP_INHERIT,
+        [OP_SEAL] = &&TARGET_OP_SEAL,
+        [OP_WIDE] = &&TARGET_OP_WIDE,
+        [OP_JUMP_FAR] = &&TARGET_OP_JUMP_FAR,
+        [OP_JUMP_IF_FALSE_FAR] = &&TARGET_OP_JUMP_IF_FALSE_FAR,
+        [OP_LOOP_FAR] = &&TARGET_OP_LOOP_FAR,
+        [OP_ADD_SMALL] = &&TARGET_OP_ADD_SMALL,
+        [OP_ADD_CONSTANT] = &&TARGET_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_SMALL] = &&TARGET_OP_SUBTRACT_SMALL,
+        [OP_SUBTRACT_CONSTANT] = &&TARGET_OP_SUBTRACT_CONSTANT,
+        [OP_LESS_SMALL] = &&TARGET_OP_LESS_SMALL,
+        [OP_LESS_CONSTANT] = &&TARGET_OP_LESS_CONSTANT,
+        [OP_LESS_EQUAL_SMALL] = &&TARGET_OP_LESS_EQUAL_SMALL,
+        [OP_LESS_EQUAL_CONSTANT] = &&TARGET_OP_LESS_EQUAL_CONSTANT,
+        [OP_GREATER_SMALL] = &&TARGET_OP_GREATER_SMALL,
+        [OP_GREATER_CONSTANT] = &&TARGET_OP_GREATER_CONSTANT,
+        [OP_GREATER_EQUAL_SMALL] = &&TARGET_OP_GREATER_EQUAL_SMALL,
+        [OP_GREATER_EQUAL_CONSTANT] = &&TARGET_OP_GREATER_EQUAL_CONSTANT,
+        [OP_REG_MOVE] = &&TARGET_OP_REG_MOVE,
+        [OP_REG_ADD] = &&TARGET_OP_REG_ADD,
+        [OP_REG_SUBTRACT] = &&TARGET_OP_REG_SUBTRACT,
+        [OP_REG_MULTIPLY] = &&TARGET_OP_REG_MULTIPLY,
+        [OP_REG_DIVIDE] = &&TARGET_OP_REG_DIVIDE,
+        [OP_REG_JUMP_UNLESS_EQUAL] = &&TARGET_OP_REG_JUMP_UNLESS_EQUAL,
+        [OP_REG_JUMP_UNLESS_NOT_EQUAL] = &&TARGET_OP_REG_JUMP_UNLESS_NOT_EQUAL,
+        [OP_REG_JUMP_UNLESS_GREATER] = &&TARGET_OP_REG_JUMP_UNLESS_GREATER,
+        [OP_REG_JUMP_UNLESS_GREATER_EQUAL] = &&TARGET_OP_REG_JUMP_UNLESS_GREATER_EQUAL,
+        [OP_REG_JUMP_UNLESS_LESS] = &&TARGET_OP_REG_JUMP_UNLESS_LESS,
+        [OP_REG_JUMP_UNLESS_LESS_EQUAL] = &&TARGET_OP_REG_JUMP_UNLESS_LESS_EQUAL,
+        [OP_REG_JUMP_UNLESS_FAR] = &&TARGET_OP_REG_JUMP_UNLESS_FAR,
+        [OP_ADD_LOCAL_LOCAL] = &&TARGET_OP_ADD_LOCAL_LOCAL,
+        [OP_GET_LOCAL_PROPERTY] = &&TARGET_OP_GET_LOCAL_PROPERTY,
+        [OP_LESS_LOCAL_LOCAL_JUMP] = &&TARGET_OP_LESS_LOCAL_LOCAL_JUMP,
+        [OP_LESS_LOCAL_SMALL_JUMP] = &&TARGET_OP_LESS_LOCAL_SMALL_JUMP,
+        [OP_LESS_LOCAL_CONSTANT_JUMP] = &&TARGET_OP_LESS_LOCAL_CONSTANT_JUMP,
+        [OP_ADD_NUM] = &&TARGET_OP_ADD_NUM,
+        [OP_ADD_STR] = &&TARGET_OP_ADD_STR,
+        [OP_GET_PROPERTY_CACHED] = &&TARGET_OP_GET_PROPERTY_CACHED,
+    };
+    void **dispatch = dispatch_table;
+#ifdef JIT
+    // While a loop iteration is recorded every instruction goes through RECORD first.
+    static void *record_table[] = {[0 ... UINT8_MAX] = &&RECORD};
+#define START_RECORDING() (dispatch = record_table)
+#define RECORDING() (dispatch == record_table)
+#endif
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) TARGET_##op:
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        goto *dispatch[READ_BYTE()]; \
+    } while (false)
+#else
+#ifdef JIT
+    bool recording = false;
+#define START_RECORDING() (recording = true)
+#define RECORDING() recording
+#define RECORD_INSTRUCTION() ((void) (recording && (recording = trace_record(frame))))
+#else
+#define RECORD_INSTRUCTION() ((void) 0)
+#endif
+#define INTERPRET_LOOP for (;;) switch ((TRACE_EXECUTION(), RECORD_INSTRUCTION(), READ_BYTE()))
+#define CASE(op) case op:
+#define DISPATCH() continue
+#endif
+
+    INTERPRET_LOOP {
+        CASE(OP_CONSTANT) {
+            Value constant = READ_CONSTANT();
+            push(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL) {
+            push(NIL_VAL);
+            DISPATCH();
+        }
+        CASE(OP_TRUE) {
+            push(BOOL_VAL(true));
+            DISPATCH();
+        }
+        CASE(OP_FALSE) {
+            push(BOOL_VAL(false));
+            DISPATCH();
+        }
+        CASE(OP_POP) {
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL) {
+            uint8_t slot = READ_BYTE();
+            push(frame->slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL) {
+            if (!get_global(READ_BYTE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL) {
+            define_global(READ_BYTE());
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL) {
+            if (!set_global(READ_BYTE())) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE) {
+            uint8_t slot = READ_BYTE();
+            push(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE) {
+            uint8_t slot = READ_BYTE();
+            *frame->closure->upvalues[slot]->location = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_ENCLOSING) {
+            uint8_t slot = READ_BYTE();
+            push(vm.stack[frame->closure->frame_base + slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_ENCLOSING) {
+            uint8_t slot = READ_BYTE();
+            vm.stack[frame->closure->frame_base + slot] = peek(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY) {
+            ObjString *name = READ_STRING();
+            PropertyCache *cache = READ_PROPERTY_CACHE();
+            Value value;
+            if (cache_property(cache, peek(0), name, &value)) {
+                // the field has a slot, so the next instance with the same shape can skip the lookup.
+                frame->ip[-4] = OP_GET_PROPERTY_CACHED;
+                vm.stack_top[-1] = value;
+                DISPATCH();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtime_error("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
-                Value value;
-                if (table_get(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bind_method(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                break;
+            if (!get_property(name)) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY_CACHED) {
+            uint8_t *start = frame->ip - 1;
+            frame->ip++; // the name, only used by OP_GET_PROPERTY.
+            PropertyCache *cache = READ_PROPERTY_CACHE();
+            Value value;
+            if (!cached_property(cache, peek(0), &value)) {
+                // a different shape, OP_GET_PROPERTY caches it if it can.
+                *start = OP_GET_PROPERTY;
+                frame->ip = start;
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtime_error("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                table_set(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+            vm.stack_top[-1] = value;
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY) {
+            if (!set_property(READ_STRING())) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER) {
+            ObjString *name = READ_STRING();
+            InlineCache *cache = READ_INLINE_CACHE();
+            ObjClass *superclass = AS_CLASS(pop());
+            if (!bind_super_method(superclass, name, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!bind_method(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE) {
+            ObjString *name = READ_STRING();
+            int arg_count = READ_BYTE();
+            InlineCache *cache = READ_INLINE_CACHE();
+            ObjClass *superclass = AS_CLASS(pop());
+            if (!invoke_from_class(superclass, name, arg_count, cache)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *name = READ_STRING();
-                int arg_count = READ_BYTE();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!invoke_from_class(superclass, name, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
 
-                frame = &vm.frames[vm.frame_count - 1];
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
 
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
-            }
-            case OP_GREATER: {
-                BINARY_OP(BOOL_VAL, >);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL) {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER) {
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS) {
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL) {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL) {
+            // same result as the OP_LESS, OP_NOT it replaces, NaN included.
+            BINARY_OP(NEGATED_BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL) {
+            BINARY_OP(NEGATED_BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_ADD) {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                frame->ip[-1] = OP_ADD_NUM;
+                BINARY_OP(NUMBER_VAL, +);
+            } else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                frame->ip[-1] = OP_ADD_STR;
+                concatenate();
+            } else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_LESS: {
-                BINARY_OP(BOOL_VAL, <);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM) {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                frame->ip[-1] = OP_ADD;
+                frame->ip--;
+                DISPATCH();
             }
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    BINARY_OP(NUMBER_VAL, +);
-                } else {
-                    runtime_error("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR) {
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                frame->ip[-1] = OP_ADD;
+                frame->ip--;
+                DISPATCH();
             }
-            case OP_SUBTRACT: {
-                BINARY_OP(NUMBER_VAL, -);
-                break;
+
+            concatenate();
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT) {
+            BINARY_OP(NUMBER_VAL, -);
+            DISPATCH();
+        }
+        CASE(OP_MULTIPLY) {
+            BINARY_OP(NUMBER_VAL, *);
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE) {
+            BINARY_OP(NUMBER_VAL, /);
+            DISPATCH();
+        }
+        CASE(OP_NOT) {
+            push(BOOL_VAL(is_falsey(pop())));
+            DISPATCH();
+        }
+        CASE(OP_NEGATE) {
+            if (!IS_NUMBER(peek(0))) {
+                runtime_error("Operand must be a number");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_MULTIPLY: {
-                BINARY_OP(NUMBER_VAL, *);
-                break;
+            push(NUMBER_VAL(-AS_NUMBER(pop())));
+            DISPATCH();
+        }
+        CASE(OP_PRINT) {
+            print_value(pop());
+            write_output("\n", 1);
+            DISPATCH();
+        }
+        CASE(OP_JUMP) {
+            uint16_t offset = READ_SHORT();
+            frame->ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(peek(0))) {
+                frame->ip += offset;
             }
-            case OP_DIVIDE: {
-                BINARY_OP(NUMBER_VAL, /);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_LOOP) {
+            uint16_t offset = READ_SHORT();
+            frame->ip -= offset;
+            BACK_EDGE();
+            DISPATCH();
+        }
+        CASE(OP_JUMP_FAR) {
+            FarJump *jump = READ_FAR_JUMP();
+            frame->ip += jump->offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_FAR) {
+            FarJump *jump = READ_FAR_JUMP();
+            if (is_falsey(peek(0))) {
+                frame->ip += jump->offset;
             }
-            case OP_NOT: {
-                push(BOOL_VAL(is_falsey(pop())));
-                break;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_FAR) {
+            FarJump *jump = READ_FAR_JUMP();
+            frame->ip -= jump->offset;
+            BACK_EDGE();
+            DISPATCH();
+        }
+        CASE(OP_CALL) {
+            int arg_count = READ_BYTE();
+            if (!call_value(peek(arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_NEGATE: {
-                if (!IS_NUMBER(peek(0))) {
-                    runtime_error("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL) {
+            int arg_count = READ_BYTE();
+            if (!tail_call_value(peek(arg_count), arg_count)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_PRINT: {
-                print_value(pop());
-                printf("\n");
-                break;
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE) {
+            ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+            ObjClosure *closure = new_closure(function);
+            push(OBJ_VAL(closure));
+            capture_upvalues(frame, closure, false);
+            DISPATCH();
+        }
+        CASE(OP_CLOSE_UPVALUE) {
+            close_upvalues(vm.stack_top - 1);
+            pop();
+            DISPATCH();
+        }
+        CASE(OP_CLASS) {
+            push(OBJ_VAL(new_class(READ_STRING())));
+            DISPATCH();
+        }
+        CASE(OP_METHOD) {
+            define_method(READ_STRING());
+            DISPATCH();
+        }
+        CASE(OP_INVOKE) {
+            ObjString *method_name = READ_STRING();
+            int arg_count = READ_BYTE();
+            if (!invoke(method_name, arg_count, READ_INLINE_CACHE(), false)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_INVOKE) {
+            ObjString *method_name = READ_STRING();
+            int arg_count = READ_BYTE();
+            if (!invoke(method_name, arg_count, READ_INLINE_CACHE(), true)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (is_falsey(peek(0))) {
-                    frame->ip += offset;
+
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_WIDE) {
+            // the same ops as their narrow forms, with a 3-byte first operand.
+            uint8_t instruction = READ_BYTE();
+            int operand = read_wide_operand(frame->ip);
+            frame->ip += 3;
+            switch (instruction) {
+                case OP_CONSTANT:
+                    push(WIDE_CONSTANT());
+                    break;
+                case OP_GET_LOCAL:
+                    push(frame->slots[operand]);
+                    break;
+                case OP_SET_LOCAL:
+                    frame->slots[operand] = peek(0);
+                    break;
+                case OP_GET_UPVALUE:
+                    push(*frame->closure->upvalues[operand]->location);
+                    break;
+                case OP_SET_UPVALUE:
+                    *frame->closure->upvalues[operand]->location = peek(0);
+                    break;
+                case OP_GET_ENCLOSING:
+                    push(vm.stack[frame->closure->frame_base + operand]);
+                    break;
+                case OP_SET_ENCLOSING:
+                    vm.stack[frame->closure->frame_base + operand] = peek(0);
+                    break;
+                case OP_GET_GLOBAL:
+                    if (!get_global(operand)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                case OP_DEFINE_GLOBAL:
+                    define_global(operand);
+                    break;
+                case OP_SET_GLOBAL:
+                    if (!set_global(operand)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                case OP_GET_PROPERTY:
+                    frame->ip += 2; // the property cache, only used by the narrow form.
+                    if (!get_property(WIDE_STRING())) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                case OP_SET_PROPERTY:
+                    if (!set_property(WIDE_STRING())) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                case OP_GET_SUPER:
+                    if (!bind_super_method(AS_CLASS(pop()), WIDE_STRING(), READ_INLINE_CACHE())) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    break;
+                case OP_SUPER_INVOKE: {
+                    int arg_count = READ_BYTE();
+                    InlineCache *cache = READ_INLINE_CACHE();
+                    if (!invoke_from_class(AS_CLASS(pop()), WIDE_STRING(), arg_count, cache)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frame_count - 1];
+                    ENTER_JIT();
+                    break;
                 }
-                break;
+                case OP_INVOKE:
+                case OP_TAIL_INVOKE: {
+                    int arg_count = READ_BYTE();
+                    if (!invoke(WIDE_STRING(), arg_count, READ_INLINE_CACHE(), instruction == OP_TAIL_INVOKE)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    frame = &vm.frames[vm.frame_count - 1];
+                    ENTER_JIT();
+                    break;
+                }
+                case OP_CLOSURE: {
+                    ObjClosure *closure = new_closure(AS_FUNCTION(WIDE_CONSTANT()));
+                    push(OBJ_VAL(closure));
+                    capture_upvalues(frame, closure, true);
+                    break;
+                }
+                case OP_CLASS:
+                    push(OBJ_VAL(new_class(WIDE_STRING())));
+                    break;
+                case OP_METHOD:
+                    define_method(WIDE_STRING());
+                    break;
+                default:
+                    // unreachable
+                    break;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_INHERIT) {
+            if (!inherit()) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CALL: {
-                int arg_count = READ_BYTE();
-                if (!call_value(peek(arg_count), arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SEAL) {
+            seal_class(AS_CLASS(peek(0)));
+            DISPATCH();
+        }
+        CASE(OP_RETURN) {
+            Value result = pop();
+            close_upvalues(frame->slots);
+            vm.frame_count--;
+
+            if (vm.frame_count == 0) {
+                // Finished executing the top-level code. The entire program is done.
+
+                pop();
+                return INTERPRET_OK;
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = new_closure(function);
-                push(OBJ_VAL(closure));
-
-                for (int i = 0; i < closure->upvalue_count; ++i) {
-                    uint8_t is_local = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (is_local) {
-                        closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
 
-                break;
+            vm.stack_top = frame->slots;
+            push(result);
+            frame = &vm.frames[vm.frame_count - 1];
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_ADD_SMALL) {
+            IMMEDIATE_OP(NUMBER_VAL, a + b, READ_SMALL(), "Operands must be two numbers or two strings.");
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT) {
+            IMMEDIATE_OP(NUMBER_VAL, a + b, READ_NUMBER_CONSTANT(), "Operands must be two numbers or two strings.");
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_SMALL) {
+            IMMEDIATE_OP(NUMBER_VAL, a - b, READ_SMALL(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_CONSTANT) {
+            IMMEDIATE_OP(NUMBER_VAL, a - b, READ_NUMBER_CONSTANT(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_LESS_SMALL) {
+            IMMEDIATE_OP(BOOL_VAL, a < b, READ_SMALL(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_LESS_CONSTANT) {
+            IMMEDIATE_OP(BOOL_VAL, a < b, READ_NUMBER_CONSTANT(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL_SMALL) {
+            IMMEDIATE_OP(BOOL_VAL, !(a > b), READ_SMALL(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL_CONSTANT) {
+            IMMEDIATE_OP(BOOL_VAL, !(a > b), READ_NUMBER_CONSTANT(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_GREATER_SMALL) {
+            IMMEDIATE_OP(BOOL_VAL, a > b, READ_SMALL(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_GREATER_CONSTANT) {
+            IMMEDIATE_OP(BOOL_VAL, a > b, READ_NUMBER_CONSTANT(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL_SMALL) {
+            IMMEDIATE_OP(BOOL_VAL, !(a < b), READ_SMALL(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL_CONSTANT) {
+            IMMEDIATE_OP(BOOL_VAL, !(a < b), READ_NUMBER_CONSTANT(), "Operands must be numbers.");
+            DISPATCH();
+        }
+        CASE(OP_REG_MOVE) {
+            uint8_t dst = READ_BYTE();
+            frame->slots[dst] = READ_REGISTER();
+            DISPATCH();
+        }
+        CASE(OP_REG_ADD) {
+            uint8_t dst = READ_BYTE();
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                frame->slots[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                push(a);
+                push(b);
+                concatenate();
+                frame->slots[dst] = pop();
+            } else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_CLOSE_UPVALUE: {
-                close_upvalues(vm.stack_top - 1);
-                pop();
-                break;
+            DISPATCH();
+        }
+        CASE(OP_REG_SUBTRACT) {
+            REGISTER_BINARY_OP(-);
+            DISPATCH();
+        }
+        CASE(OP_REG_MULTIPLY) {
+            REGISTER_BINARY_OP(*);
+            DISPATCH();
+        }
+        CASE(OP_REG_DIVIDE) {
+            REGISTER_BINARY_OP(/);
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_EQUAL) {
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            uint16_t offset = READ_SHORT();
+            if (!values_equal(a, b)) {
+                frame->ip += offset;
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(new_class(READ_STRING())));
-                break;
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_NOT_EQUAL) {
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            uint16_t offset = READ_SHORT();
+            if (values_equal(a, b)) {
+                frame->ip += offset;
             }
-            case OP_METHOD: {
-                define_method(READ_STRING());
-                break;
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_GREATER) {
+            REGISTER_COMPARE_JUMP(a > b);
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_GREATER_EQUAL) {
+            // matches OP_GREATER_EQUAL.
+            REGISTER_COMPARE_JUMP(!(a < b));
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_LESS) {
+            REGISTER_COMPARE_JUMP(a < b);
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_LESS_EQUAL) {
+            REGISTER_COMPARE_JUMP(!(a > b));
+            DISPATCH();
+        }
+        CASE(OP_REG_JUMP_UNLESS_FAR) {
+            Value a = READ_REGISTER();
+            Value b = READ_REGISTER();
+            FarJump *jump = READ_FAR_JUMP();
+            bool holds;
+            if (!register_condition(jump->instruction, a, b, &holds)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_INVOKE: {
-                ObjString *method_name = READ_STRING();
-                int arg_count = READ_BYTE();
-                if (!invoke(method_name, arg_count)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            if (!holds) {
+                frame->ip += jump->offset;
             }
-            case OP_INHERIT: {
-                Value super_class = peek(1);
-                if (!IS_CLASS(super_class)) {
-                    runtime_error("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjClass *sub_class = AS_CLASS(peek(0));
-                table_add_all(&AS_CLASS(super_class)->methods, &sub_class->methods);
-
-                // Subclass
-                pop();
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_LOCAL) {
+            // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+            Value a = frame->slots[FUSED_BYTE(0)];
+            Value b = frame->slots[FUSED_BYTE(2)];
+            frame->ip += 4;
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else if (IS_STRING(a) && IS_STRING(b)) {
+                push(a);
+                push(b);
+                concatenate();
+            } else {
+                runtime_error("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL_PROPERTY) {
+            // OP_GET_LOCAL slot, OP_GET_PROPERTY name cache
+            Value receiver = frame->slots[FUSED_BYTE(0)];
+            ObjString *name = AS_STRING(frame->closure->function->chunk.constants.values[FUSED_BYTE(2)]);
+            PropertyCache *cache = &frame->closure->function->chunk.property_caches[FUSED_SHORT(3)];
+            frame->ip += 5;
+            Value value;
+            if (cached_property(cache, receiver, &value) || cache_property(cache, receiver, name, &value)) {
+                push(value);
+                DISPATCH();
             }
-            case OP_RETURN: {
-                Value result = pop();
-                close_upvalues(frame->slots);
-                vm.frame_count--;
-
-                if (vm.frame_count == 0) {
-                    // Finished executing the top-level code. The entire program is done.
-
-                    pop();
-                    return INTERPRET_OK;
-                }
 
-                vm.stack_top = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+            push(receiver);
+            if (!get_property(name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_LOCAL_JUMP) {
+            // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_LESS, OP_JUMP_IF_FALSE offset
+            FUSED_LESS_JUMP(frame->slots[FUSED_BYTE(2)], 8);
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_SMALL_JUMP) {
+            // OP_GET_LOCAL a, OP_LESS_SMALL b, OP_JUMP_IF_FALSE offset
+            FUSED_LESS_JUMP(NUMBER_VAL(FUSED_BYTE(2)), 7);
+            DISPATCH();
         }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP) {
+            // OP_GET_LOCAL a, OP_LESS_CONSTANT b, OP_JUMP_IF_FALSE offset
+            FUSED_LESS_JUMP(frame->closure->function->chunk.constants.values[FUSED_BYTE(2)], 7);
+            DISPATCH();
+        }
+#if defined(JIT) && defined(COMPUTED_GOTO)
+        RECORD:
+            frame->ip--;
+            if (!trace_record(frame)) {
+                dispatch = dispatch_table;
+            }
+            goto *dispatch_table[READ_BYTE()];
+#endif
     }
 
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_INLINE_CACHE
+#undef READ_FAR_JUMP
+#undef READ_PROPERTY_CACHE
+#undef WIDE_CONSTANT
+#undef WIDE_STRING
 #undef BINARY_OP
+#undef NEGATED_BOOL_VAL
+#undef IMMEDIATE_OP
+#undef READ_SMALL
+#undef READ_NUMBER_CONSTANT
+#undef READ_REGISTER
+#undef REGISTER_BINARY_OP
+#undef REGISTER_COMPARE_JUMP
+#undef FUSED_BYTE
+#undef FUSED_SHORT
+#undef FUSED_LESS_JUMP
+#undef ENTER_JIT
+#undef BACK_EDGE
+#undef START_RECORDING
+#undef RECORDING
+#undef RECORD_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *source) {
@@ -600,5 +1935,15 @@ InterpretResult interpret(const char *source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    sigjmp_buf stack_overflow;
+    if (sigsetjmp(stack_overflow, 1) != 0) {
+        vm.stack_overflow = NULL;
+        runtime_error("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    vm.stack_overflow = &stack_overflow;
+    InterpretResult result = run();
+    vm.stack_overflow = NULL;
+    return result;
 }
@@ -5,13 +5,30 @@
 #ifndef C_LOX_VM_H
 #define C_LOX_VM_H
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
-
-#define FRAME_MAX 64
+#include "output.h"
+
+// The frames and the value stack start small and grow on demand, up to these hard limits past which a call is a
+// stack overflow. Both can be set at build time, e.g. -DFRAME_MAX=100000.
+#ifndef FRAME_MAX
+#define FRAME_MAX 4096
+#endif
+#ifndef STACK_MAX
 #define STACK_MAX (FRAME_MAX * UINT8_COUNT)
+#endif
+
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL UINT8_COUNT
+
+// The values the VM pushes above what a frame's own instructions do, to keep objects it is making reachable, see
+// strings_equal(). call() makes room for them along with the function's stack_size. Nothing checks the pushes
+// themselves, a push past that room faults on the guard page after the stack.
+#define FRAME_HEADROOM 8
 
 typedef struct CallFrame {
     ObjClosure *closure;
@@ -25,23 +42,39 @@ typedef struct CallFrame {
 } CallFrame;
 
 typedef struct VirtualMachine {
-    CallFrame frames[FRAME_MAX];
+    // Both arrays move when they grow, see grow_frames() and grow_stack(): hold on to an index into them rather than
+    // a pointer across anything that can call a function or push a value.
+    CallFrame *frames;
+    int frame_capacity;
     // the number of ongoing function calls.
     int frame_count;
 
-    Value stack[STACK_MAX];
+    // followed by a guard page, where a push past the end of the stack faults.
+    Value *stack;
+    int stack_capacity;
     Value *stack_top;
-    Table globals;
+    // where to go on such a fault while code runs, to report a stack overflow, or NULL.
+    sigjmp_buf *stack_overflow;
+    // the slot index of each global variable by name, assigned by the compiler.
+    Table global_slots;
+    // the name of each global slot, for error messages.
+    ValueArray global_names;
+    // the value of each global slot, UNDEFINED_VAL until its declaration runs.
+    ValueArray global_values;
     Table strings;
     ObjString *init_string;
-    // a linked list
+    // a linked list, sorted by the slot each upvalue points to, topmost first.
     ObjUpvalue *open_upvalues;
+    // the open upvalue of each stack slot, or NULL, so capturing a slot doesn't walk the list to find it.
+    // Indexed by slot, it stays valid when the stack moves.
+    ObjUpvalue **open_upvalue_slots;
     size_t bytes_allocated;
     size_t next_gc;
     Obj *objects;
     int gray_count;
     int gray_capacity;
     Obj **gray_stack;
+    Output output;
 } VirtualMachine;
 
 typedef enum {
@@ -60,7 +93,15 @@ InterpretResult interpret(const char *source);
 
 void push(Value val);
 
+// Makes room for count more values on the stack, for pushes outside of any frame.
+void reserve_stack(int count);
+
 Value pop();
 
+int global_slot(ObjString *name);
+
+// Reports a runtime error with a stack trace of the frames running, and unwinds them.
+void runtime_error(const char *format, ...);
+
 
 #endif //C_LOX_VM_H